@@ -0,0 +1,812 @@
+/* C++ adaptors for arena.h, pool.h and buddy.h
+ *
+ * Example usage:
+ *
+ *     #include "allocators.hpp"
+ *
+ *     int main()
+ *     {
+ *         allocators::arena_resource arena;
+ *         std::pmr::vector<int> v(&arena);
+ *
+ *         allocators::pool_resource<64> pool;
+ *         std::list<int, allocators::pool_allocator<int, 64>> l(pool);
+ *
+ *         std::vector<int, allocators::buddy_allocator<int>> b;
+ *
+ *         std::map<int, int, std::less<int>,
+ *                  allocators::class_allocator<std::pair<const int, int>>> m;
+ *     }
+ *
+ * Only the declarations of the C headers are included, their
+ * implementations are compiled in a C file as usual, with the
+ * same ARENA_STATS, ARENA_NO_MMAP and POOL_STATS as here.
+ *
+ * The memory resources are for std::pmr containers. The
+ * allocators take the same memory without virtual calls:
+ * pool_allocator<T, BlockSize> pops single objects of at most
+ * BlockSize bytes off the free list of its pool_resource inline,
+ * which is what node based containers (std::list, std::map,
+ * std::set, ...) allocate. Everything else goes to the upstream
+ * resource of the pool.
+ *
+ * class_allocator<T> needs no resource: its objects come from a
+ * static_pool picked at compile time, shared by every type of
+ * the same size class, see size_class. Each thread has its own
+ * static pools, handed on when it exits, or with
+ * POOL_THREAD_SAFE threads share locked ones.
+ *
+ * Failures throw std::bad_alloc. Like the C types, arena and
+ * pool resources are not thread safe.
+ *
+ * Needs C++17.
+ */
+
+#ifndef ALLOCATORS_HPP
+#define ALLOCATORS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+#include "arena.h"
+#include "pool.h"
+#include "buddy.h"
+
+namespace allocators {
+
+/*
+ * A monotonic resource over an arena: deallocate does nothing,
+ * and release frees everything at once with arena_clear.
+ */
+class arena_resource final : public std::pmr::memory_resource {
+public:
+    /*
+     * Uses a growable arena of its own, starting with a chunk
+     * of `size` bytes.
+     */
+    explicit arena_resource(std::size_t size = 64 * 1024)
+        : arena_(&own_), owned_(true)
+    {
+        if (arena_init_growable(&own_, size) == -1)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    /*
+     * Uses `arena`, which stays the caller's to free, such as
+     * one from arena_init_huge or arena_init_reserved.
+     */
+    explicit arena_resource(arena_t &arena) noexcept
+        : arena_(&arena), owned_(false)
+    {
+    }
+
+    arena_resource(const arena_resource &) = delete;
+    arena_resource &operator=(const arena_resource &) = delete;
+
+    ~arena_resource() override
+    {
+        if (owned_)
+        {
+            arena_free(&own_);
+        }
+    }
+
+    void release() noexcept
+    {
+        arena_clear(arena_);
+    }
+
+    arena_t *arena() const noexcept
+    {
+        return arena_;
+    }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        void *ptr = arena_alloc_aligned(arena_, bytes, align);
+
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) noexcept override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other)
+        const noexcept override
+    {
+        return this == &other;
+    }
+
+    arena_t own_;
+    arena_t *arena_;
+    bool owned_;
+};
+
+/*
+ * A pool of blocks of BlockSize bytes, with chunks and requests
+ * that don't fit a block taken from `upstream`.
+ */
+template <std::size_t BlockSize>
+class pool_resource final : public std::pmr::memory_resource {
+    static_assert(BlockSize > 0, "pool_resource: empty blocks");
+
+public:
+    /* the size and alignment of the blocks, as pool_init makes them */
+    static constexpr std::size_t block_size =
+        (BlockSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    static constexpr std::size_t block_align =
+        (block_size & -block_size) < alignof(std::max_align_t) ?
+        (block_size & -block_size) : alignof(std::max_align_t);
+
+    /* whether single objects of type T come from the pool */
+    template <class T>
+    static constexpr bool holds =
+        sizeof(T) <= block_size && alignof(T) <= block_align;
+
+    explicit pool_resource(std::pmr::memory_resource *upstream =
+                               std::pmr::get_default_resource())
+        : upstream_(upstream)
+    {
+        const pool_backing_t backing = { chunk_alloc, chunk_free, upstream };
+
+        if (pool_init(&pool_, BlockSize, &backing) == -1)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    pool_resource(const pool_resource &) = delete;
+    pool_resource &operator=(const pool_resource &) = delete;
+
+    ~pool_resource() override
+    {
+        pool_destroy(&pool_);
+    }
+
+    /*
+     * Pops a block off the free list, and only calls into
+     * pool.h to carve one when it is empty.
+     */
+    void *allocate_block()
+    {
+        void *ptr = pool_.free_head;
+
+        if (ptr != nullptr)
+        {
+            pool_.free_head = *static_cast<void **>(ptr);
+#ifdef POOL_STATS
+            pool_.allocs++;
+#endif
+            return ptr;
+        }
+
+        ptr = pool_alloc(&pool_);
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    void deallocate_block(void *ptr) noexcept
+    {
+#ifdef POOL_STATS
+        pool_.frees++;
+#endif
+        *static_cast<void **>(ptr) = pool_.free_head;
+        pool_.free_head = ptr;
+    }
+
+    /* frees every block and the chunks behind them */
+    void release() noexcept
+    {
+        pool_destroy(&pool_);
+    }
+
+    std::pmr::memory_resource *upstream_resource() const noexcept
+    {
+        return upstream_;
+    }
+
+    pool_t *pool() noexcept
+    {
+        return &pool_;
+    }
+
+private:
+    static void *chunk_alloc(std::size_t size, void *ctx)
+    {
+        try
+        {
+            return static_cast<std::pmr::memory_resource *>(ctx)->allocate(
+                size, alignof(std::max_align_t));
+        }
+        catch (const std::bad_alloc &)
+        {
+            return nullptr;
+        }
+    }
+
+    static void chunk_free(void *ptr, std::size_t size, void *ctx)
+    {
+        static_cast<std::pmr::memory_resource *>(ctx)->deallocate(
+            ptr, size, alignof(std::max_align_t));
+    }
+
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        if (bytes <= block_size && align <= block_align)
+        {
+            return allocate_block();
+        }
+
+        return upstream_->allocate(bytes, align);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t align)
+        noexcept override
+    {
+        if (bytes <= block_size && align <= block_align)
+        {
+            deallocate_block(ptr);
+            return;
+        }
+
+        upstream_->deallocate(ptr, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other)
+        const noexcept override
+    {
+        return this == &other;
+    }
+
+    pool_t pool_;
+    std::pmr::memory_resource *upstream_;
+};
+
+/*
+ * bfree_sized and bfree_aligned_sized get the sizes back from
+ * the containers, so frees skip finding the block's order.
+ */
+class buddy_resource final : public std::pmr::memory_resource {
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        void *ptr = align <= alignof(std::max_align_t) ?
+                    balloc(bytes > 0 ? bytes : 1) :
+                    baligned_alloc(align, bytes > 0 ? bytes : 1);
+
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t align)
+        noexcept override
+    {
+        if (align <= alignof(std::max_align_t))
+        {
+            bfree_sized(ptr, bytes > 0 ? bytes : 1);
+        }
+        else
+        {
+            bfree_aligned_sized(ptr, align, bytes > 0 ? bytes : 1);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other)
+        const noexcept override
+    {
+        // all of them share the one buddy heap
+        return dynamic_cast<const buddy_resource *>(&other) != nullptr;
+    }
+};
+
+/*
+ * The buddy_resource shared by everyone, which lives as long
+ * as the program.
+ */
+inline buddy_resource *buddy_memory() noexcept
+{
+    static buddy_resource resource;
+    return &resource;
+}
+
+/*
+ * An allocator over a pool_resource<BlockSize>. Containers
+ * rebind it to their node types, whose single allocations
+ * come from the pool when they fit in a block.
+ */
+template <class T, std::size_t BlockSize>
+class pool_allocator {
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind {
+        using other = pool_allocator<U, BlockSize>;
+    };
+
+    pool_allocator(pool_resource<BlockSize> &resource) noexcept
+        : resource_(&resource)
+    {
+    }
+
+    template <class U>
+    pool_allocator(const pool_allocator<U, BlockSize> &other) noexcept
+        : resource_(other.resource())
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        if constexpr (pool_resource<BlockSize>::template holds<T>)
+        {
+            if (n == 1)
+            {
+                return static_cast<T *>(resource_->allocate_block());
+            }
+        }
+
+        if (n > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+
+        return static_cast<T *>(
+            resource_->upstream_resource()->allocate(n * sizeof(T),
+                                                     alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        if constexpr (pool_resource<BlockSize>::template holds<T>)
+        {
+            if (n == 1)
+            {
+                resource_->deallocate_block(ptr);
+                return;
+            }
+        }
+
+        resource_->upstream_resource()->deallocate(ptr, n * sizeof(T),
+                                                   alignof(T));
+    }
+
+    pool_resource<BlockSize> *resource() const noexcept
+    {
+        return resource_;
+    }
+
+private:
+    pool_resource<BlockSize> *resource_;
+};
+
+template <class T, class U, std::size_t BlockSize>
+bool operator==(const pool_allocator<T, BlockSize> &a,
+                const pool_allocator<U, BlockSize> &b) noexcept
+{
+    return a.resource() == b.resource();
+}
+
+template <class T, class U, std::size_t BlockSize>
+bool operator!=(const pool_allocator<T, BlockSize> &a,
+                const pool_allocator<U, BlockSize> &b) noexcept
+{
+    return !(a == b);
+}
+
+/*
+ * The block sizes of the static pools class_allocator uses,
+ * in steps of an eighth to a sixteenth of the size at most.
+ */
+inline constexpr std::size_t size_classes[] = {
+    8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024
+};
+
+/* the largest power of two dividing `size`, up to max_align_t */
+constexpr std::size_t natural_align(std::size_t size)
+{
+    return (size & -size) < alignof(std::max_align_t) ?
+           (size & -size) : alignof(std::max_align_t);
+}
+
+/*
+ * The block size of the pool for objects of `size` bytes
+ * aligned to `align`: the smallest size class holding them
+ * whose blocks are aligned enough, or past the last class
+ * `size` rounded up to `align` and the size of a pointer.
+ */
+constexpr std::size_t size_class(std::size_t size, std::size_t align)
+{
+    for (std::size_t block_size : size_classes)
+    {
+        if (block_size >= size && natural_align(block_size) >= align)
+        {
+            return block_size;
+        }
+    }
+
+    // room for the free list link
+    if (align < sizeof(void *))
+    {
+        align = sizeof(void *);
+    }
+
+    return (size + align - 1) & -align;
+}
+
+/*
+ * A pool of its own for each BlockSize, with its free list and
+ * the chunk blocks are carved from in static storage. Chunks
+ * double up to 1 MiB, come from malloc and are never freed.
+ *
+ * Every type of a size class shares the pool without knowing,
+ * so each thread has a pool of its own, and blocks freed by
+ * another thread join the free list of that thread. When a
+ * thread exits, its free list and the rest of its chunk go to
+ * a list of orphans, which threads take over before growing.
+ * With POOL_THREAD_SAFE, as for the global pool of pool.h,
+ * threads share one pool under a lock instead.
+ */
+template <std::size_t BlockSize>
+class static_pool {
+    static_assert(BlockSize % sizeof(void *) == 0,
+                  "static_pool: blocks must hold the free list link");
+
+public:
+    static constexpr std::size_t block_size = BlockSize;
+    static constexpr std::size_t block_align = natural_align(BlockSize);
+
+    static void *allocate()
+    {
+#ifdef POOL_THREAD_SAFE
+        std::lock_guard<std::mutex> guard(lock_);
+#endif
+        state &pool = state_;
+        void *ptr = pool.free_head;
+
+        if (ptr != nullptr)
+        {
+            pool.free_head = *static_cast<void **>(ptr);
+            return ptr;
+        }
+
+        if (static_cast<std::size_t>(pool.end - pool.front) < block_size)
+        {
+#ifndef POOL_THREAD_SAFE
+            if (!enroll(pool))
+            {
+                return stray();
+            }
+
+            ptr = orphans_.exchange(nullptr, std::memory_order_acquire);
+            if (ptr != nullptr)
+            {
+                pool.free_head = *static_cast<void **>(ptr);
+                return ptr;
+            }
+#endif
+            more(pool);
+        }
+
+        ptr = pool.front;
+        pool.front += block_size;
+        return ptr;
+    }
+
+    static void deallocate(void *ptr) noexcept
+    {
+#ifdef POOL_THREAD_SAFE
+        std::lock_guard<std::mutex> guard(lock_);
+#endif
+        state &pool = state_;
+
+#ifndef POOL_THREAD_SAFE
+        if (!enroll(pool))
+        {
+            orphan(ptr, ptr);
+            return;
+        }
+#endif
+        *static_cast<void **>(ptr) = pool.free_head;
+        pool.free_head = ptr;
+    }
+
+private:
+    enum status { unseen, live, exited };
+
+    struct state {
+        void *free_head = nullptr;
+        unsigned char *front = nullptr;
+        unsigned char *end = nullptr;
+        std::size_t chunk_size = block_size > 4096 / 8 ?
+                                 block_size * 8 : 4096;
+        status status_ = unseen;
+    };
+
+    static void more(state &pool)
+    {
+        // malloc aligns to max_align_t, which block_align
+        // never exceeds
+        unsigned char *chunk =
+            static_cast<unsigned char *>(std::malloc(pool.chunk_size));
+
+        if (chunk == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        // only called once the old chunk can't fit another
+        // block, so nothing usable is dropped here
+        pool.front = chunk;
+        pool.end = chunk + pool.chunk_size / block_size * block_size;
+
+        if (pool.chunk_size < 1024 * 1024)
+        {
+            pool.chunk_size *= 2;
+        }
+    }
+
+#ifdef POOL_THREAD_SAFE
+    static inline state state_;
+    static inline std::mutex lock_;
+#else
+    /* gives the pool of the thread back when the thread exits */
+    struct reaper {
+        ~reaper()
+        {
+            disown(state_);
+        }
+    };
+
+    /*
+     * Whether the pool of the thread is still there, arming the
+     * reaper the first time. Objects freed while the thread
+     * exits, after the reaper has run, go to the orphans.
+     */
+    static bool enroll(state &pool) noexcept
+    {
+        if (pool.status_ == unseen)
+        {
+            // the first use of a thread_local with a destructor
+            // has it called at thread exit
+            static_cast<void>(&reaper_);
+            pool.status_ = live;
+        }
+
+        return pool.status_ == live;
+    }
+
+    /* pushes the blocks from first to last onto the orphans */
+    static void orphan(void *first, void *last) noexcept
+    {
+        void *head = orphans_.load(std::memory_order_relaxed);
+
+        // only ever emptied whole, so no ABA
+        do
+        {
+            *static_cast<void **>(last) = head;
+        }
+        while (!orphans_.compare_exchange_weak(head, first,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+
+    /* allocates for a thread whose pool is gone */
+    static void *stray()
+    {
+        state pool;
+        void *ptr = orphans_.exchange(nullptr, std::memory_order_acquire);
+
+        if (ptr != nullptr)
+        {
+            pool.free_head = *static_cast<void **>(ptr);
+        }
+        else
+        {
+            more(pool);
+            ptr = pool.front;
+            pool.front += block_size;
+        }
+
+        disown(pool);
+        return ptr;
+    }
+
+    static void disown(state &pool) noexcept
+    {
+        void *first = pool.free_head;
+        void *last;
+
+        while (static_cast<std::size_t>(pool.end - pool.front) >= block_size)
+        {
+            *reinterpret_cast<void **>(pool.front) = first;
+            first = pool.front;
+            pool.front += block_size;
+        }
+
+        if (first != nullptr)
+        {
+            last = first;
+            while (*static_cast<void **>(last) != nullptr)
+            {
+                last = *static_cast<void **>(last);
+            }
+            orphan(first, last);
+        }
+
+        pool.free_head = nullptr;
+        pool.front = nullptr;
+        pool.end = nullptr;
+        pool.status_ = exited;
+    }
+
+    static inline thread_local state state_;
+    static inline thread_local reaper reaper_;
+    static inline std::atomic<void *> orphans_{nullptr};
+#endif
+};
+
+/* the static_pool single objects of type T come from */
+template <class T>
+using class_pool = static_pool<size_class(sizeof(T), alignof(T))>;
+
+/*
+ * An allocator taking single objects from the static_pool of
+ * their size class, and arrays from malloc. Containers rebind
+ * it to their node types, so 40 byte nodes take 40 byte
+ * blocks.
+ */
+template <class T>
+class class_allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    class_allocator() noexcept = default;
+
+    template <class U>
+    class_allocator(const class_allocator<U> &) noexcept
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        void *ptr;
+
+        if constexpr (class_pool<T>::block_align >= alignof(T))
+        {
+            if (n == 1)
+            {
+                return static_cast<T *>(class_pool<T>::allocate());
+            }
+        }
+
+        if (n > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+
+        ptr = ::operator new(n * sizeof(T), std::align_val_t(alignof(T)));
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        if constexpr (class_pool<T>::block_align >= alignof(T))
+        {
+            if (n == 1)
+            {
+                class_pool<T>::deallocate(ptr);
+                return;
+            }
+        }
+
+        ::operator delete(ptr, n * sizeof(T), std::align_val_t(alignof(T)));
+    }
+};
+
+template <class T, class U>
+bool operator==(const class_allocator<T> &, const class_allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const class_allocator<T> &, const class_allocator<U> &) noexcept
+{
+    return false;
+}
+
+/*
+ * An allocator over the buddy heap, with sized frees.
+ */
+template <class T>
+class buddy_allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    buddy_allocator() noexcept = default;
+
+    template <class U>
+    buddy_allocator(const buddy_allocator<U> &) noexcept
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        void *ptr;
+
+        if (n > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+
+        if constexpr (alignof(T) <= alignof(std::max_align_t))
+        {
+            ptr = balloc(n > 0 ? n * sizeof(T) : 1);
+        }
+        else
+        {
+            ptr = baligned_alloc(alignof(T), n > 0 ? n * sizeof(T) : 1);
+        }
+
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        if constexpr (alignof(T) <= alignof(std::max_align_t))
+        {
+            bfree_sized(ptr, n > 0 ? n * sizeof(T) : 1);
+        }
+        else
+        {
+            bfree_aligned_sized(ptr, alignof(T), n > 0 ? n * sizeof(T) : 1);
+        }
+    }
+};
+
+template <class T, class U>
+bool operator==(const buddy_allocator<T> &, const buddy_allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const buddy_allocator<T> &, const buddy_allocator<U> &) noexcept
+{
+    return false;
+}
+
+}
+
+#endif
@@ -1,3 +1,8 @@
+#if defined(ARENA_IMPLEMENTATION) && !defined(ARENA_NO_MMAP) && !defined(_GNU_SOURCE)
+/* for MAP_ANONYMOUS and MADV_HUGEPAGE,
+ * if nothing was included before us */
+#define _GNU_SOURCE
+#endif
 
 /* Arena allocator
  *
@@ -17,6 +22,70 @@
  *         arena_free(&A);
  *     }
  *
+ * An arena made with arena_init_growable chains a new chunk,
+ * twice the size of the last, when it runs out of room instead
+ * of failing.
+ *
+ * Each thread also has ARENA_SCRATCH_COUNT growable scratch
+ * arenas, made on first use, for temporary allocations:
+ *
+ *     arena_scratch_t S = arena_scratch_begin(&result_arena, 1);
+ *     void *tmp = arena_alloc(S.arena, 128);
+ *     arena_scratch_end(S);
+ *
+ * Define ARENA_NO_SCRATCH to leave them out.
+ *
+ * Define ARENA_STATS, in every file including arena.h, to
+ * keep counts and the high-water mark for arena_stats.
+ *
+ * An arena made with arena_init_huge is mapped in whole huge
+ * pages of 1 << ARENA_HUGE_ORDER bytes, 2 MiB by default,
+ * to spare the TLB in large arenas. They are transparent huge
+ * pages, or hugetlb pages when ARENA_HUGETLB is defined and
+ * the system has enough of them.
+ *
+ * An arena made with arena_init_reserved reserves address space
+ * without memory behind it, and commits it ARENA_COMMIT_SIZE
+ * bytes at a time as allocations reach it. Its memory never
+ * moves, and arena_clear gives back what lies past the amount
+ * it was told to retain:
+ *
+ *     arena_t A;
+ *     assert(arena_init_reserved(&A, (size_t) 1 << 30, 1 << 20) != -1);
+ *
+ * An arena made with arena_init_file lives in a file mapped with
+ * MAP_SHARED, so what was allocated from it is there again when
+ * the file is mapped next time, by this process or another, read
+ * only or copy-on-write. Since the file may be mapped anywhere,
+ * what is in it points into it by offsets, and arena_root finds
+ * where to start:
+ *
+ *     arena_t A;
+ *     assert(arena_init_file(&A, "index", 1 << 30, ARENA_FILE_CREATE) != -1);
+ *     struct node *root = arena_alloc(&A, sizeof(*root));
+ *     root->next = arena_offset(&A, arena_alloc(&A, sizeof(*root)));
+ *     arena_set_root(&A, root);
+ *     arena_sync(&A);
+ *     arena_free(&A);
+ *
+ *     assert(arena_init_file(&A, "index", 0, ARENA_FILE_READ) != -1);
+ *     root = arena_root(&A);
+ *     struct node *next = arena_pointer(&A, root->next);
+ *
+ * A pool_t of pool.h links its free list by pointers, so it does
+ * not persist. An arena_pool_t does: it lives in the file arena
+ * it takes blocks from, and links them by offsets:
+ *
+ *     arena_pool_t *nodes = arena_alloc(&A, sizeof(*nodes));
+ *     arena_pool_init(nodes, sizeof(struct node));
+ *     struct node *node = arena_pool_alloc(&A, nodes);
+ *     arena_pool_free(&A, nodes, node);
+ *
+ * and is found again through the root like everything else.
+ *
+ * Define ARENA_NO_MMAP, in every file including arena.h, to
+ * leave out all kinds of mapped arenas.
+ *
  */
 
 #ifndef ARENA_H
@@ -25,12 +94,94 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * `mem` and `size` are the current chunk, growable arenas
+ * link their earlier chunks from a header in front of it.
+ * `next_size` is the size of the chunk they get next, and
+ * 0 for fixed arenas. `prior` is the size of the earlier
+ * chunks. `mapped` is the length of the mapping of arenas
+ * from arena_init_huge, arena_init_reserved and arena_init_file,
+ * and 0 for the others. Of a mapping, the first `size` bytes are
+ * committed, and arena_clear keeps `retain` of them. `file` is
+ * the header of the file in front of `mem`, for file arenas.
+ */
 typedef struct {
     size_t front;
     size_t size;
     uint8_t *mem;
+    size_t next_size;
+#ifndef ARENA_NO_MMAP
+    size_t mapped;
+    size_t retain;
+    struct arena_file *file;
+#endif
+#ifdef ARENA_STATS
+    size_t allocs;
+    size_t prior;
+    size_t peak;
+#endif
 } arena_t;
 
+#ifndef ARENA_NO_MMAP
+/*
+ * How arena_init_file maps the file. ARENA_FILE_CREATE makes a
+ * new, empty one, ARENA_FILE_SHARED goes on allocating from it,
+ * and both write to it. ARENA_FILE_READ maps it read only, with
+ * no room to allocate, and must not be cleared. Allocations from
+ * an ARENA_FILE_PRIVATE arena are copy-on-write, never written to
+ * the file.
+ */
+enum {
+    ARENA_FILE_CREATE,
+    ARENA_FILE_SHARED,
+    ARENA_FILE_READ,
+    ARENA_FILE_PRIVATE
+};
+
+/* the bytes the file header takes in front of the arena */
+#define ARENA_FILE_HEADER 64
+
+/*
+ * Blocks of `block_size` bytes in a file arena, and the offset
+ * of the first free one, which holds the offset of the next.
+ */
+typedef struct {
+    uint64_t block_size;
+    uint64_t free;
+} arena_pool_t;
+#endif
+
+#ifdef ARENA_STATS
+typedef struct {
+    size_t allocs;      /* allocations so far */
+    size_t used;        /* bytes allocated, with padding and
+                           the unused ends of earlier chunks */
+    size_t peak;        /* the most bytes used so far */
+    size_t reserved;    /* bytes of all chunks */
+    size_t chunks;      /* the number of chunks */
+} arena_stats_t;
+#endif
+
+/*
+ * A point in an arena to rewind to.
+ */
+typedef struct {
+    uint8_t *mem;
+    size_t front;
+} arena_mark_t;
+
+/*
+ * A scratch arena in use, and where to rewind it to.
+ */
+typedef struct {
+    arena_t *arena;
+    arena_mark_t mark;
+} arena_scratch_t;
+
 /*
  * Initializes a new arena of size `size`
  * using malloc, or ARENA_MALLOC if ARENA_NO_STDLIB
@@ -43,6 +194,101 @@ int arena_init(arena_t *A, size_t size);
  */
 void arena_init_prealloc(arena_t *A, void *mem, size_t size);
 
+/*
+ * Initializes a new arena with a first chunk of size
+ * `size`, which grows by chaining new chunks from malloc,
+ * or ARENA_MALLOC if ARENA_NO_STDLIB is defined.
+ * Returns -1 on failure and 0 otherwise.
+ */
+int arena_init_growable(arena_t *A, size_t size);
+
+#ifndef ARENA_NO_MMAP
+/*
+ * Initializes a new arena of at least `size` bytes mapped
+ * on huge pages, `size` rounded up to whole huge pages.
+ * The memory reads as zero. Returns -1 on failure and 0
+ * otherwise.
+ */
+int arena_init_huge(arena_t *A, size_t size);
+
+/*
+ * Initializes a new arena reserving `reserve` bytes of address
+ * space, committed as it is allocated from. arena_clear
+ * decommits all but the first `retain` bytes. Both are rounded
+ * up to ARENA_COMMIT_SIZE. Returns -1 on failure and 0
+ * otherwise.
+ */
+int arena_init_reserved(arena_t *A, size_t reserve, size_t retain);
+
+/*
+ * Initializes a new arena in the file at `path`, mapped as `mode`
+ * tells. ARENA_FILE_CREATE makes the file `size` bytes, plus
+ * the header and rounded up to the page size, other modes ignore
+ * `size` and pick up where the last arena_sync of the file left
+ * off. Returns -1 on failure, including files not made by
+ * arena_init_file, and 0 otherwise.
+ */
+int arena_init_file(arena_t *A, const char *path, size_t size, int mode);
+
+/*
+ * Records what was allocated from `A`, which is from arena_init_file
+ * with ARENA_FILE_CREATE or ARENA_FILE_SHARED, and writes it out.
+ * Returns -1 on failure, including arenas not in a file, and 0
+ * otherwise.
+ */
+int arena_sync(arena_t *A);
+
+/*
+ * Makes `ptr`, in file arena `A`, what arena_root returns from
+ * now on, in the file once it is synced. Not for ARENA_FILE_READ.
+ * Returns -1 if `A` is not in a file and 0 otherwise.
+ */
+int arena_set_root(arena_t *A, void *ptr);
+
+/*
+ * Returns the pointer given to arena_set_root, or NULL
+ * (ARENA_NULL) if there was none or `A` is not in a file.
+ */
+void *arena_root(arena_t *A);
+
+/*
+ * Initializes a pool of blocks of `block_size` bytes, rounded
+ * up to hold an offset. `P` is in the file arena the blocks
+ * come from, for the pool to persist.
+ */
+void arena_pool_init(arena_pool_t *P, size_t block_size);
+
+/*
+ * Allocates a block of pool `P` from file arena `A`, a freed one
+ * if there is any. Returns NULL, or ARENA_NULL if ARENA_NO_STDLIB
+ * is defined, when `A` is full.
+ */
+void *arena_pool_alloc(arena_t *A, arena_pool_t *P);
+
+/*
+ * Gives `ptr`, from arena_pool_alloc of `A` and `P`, back to `P`.
+ */
+void arena_pool_free(arena_t *A, arena_pool_t *P, void *ptr);
+
+/*
+ * The offset of `ptr` in file arena `A`, the same wherever the
+ * file is mapped. 0 for a null `ptr`, which no allocation has.
+ */
+static inline uint64_t arena_offset(const arena_t *A, const void *ptr)
+{
+    return ptr ? (uint64_t) ((const uint8_t *) ptr - A->mem) +
+                 ARENA_FILE_HEADER : 0;
+}
+
+/*
+ * The pointer at `offset` from arena_offset in file arena `A`.
+ */
+static inline void *arena_pointer(const arena_t *A, uint64_t offset)
+{
+    return offset ? A->mem + (offset - ARENA_FILE_HEADER) : (void *) 0;
+}
+#endif
+
 /*
  * Frees underlying memory using free, or
  * ARENA_FREE if ARENA_NO_STDLIB is defined.
@@ -50,17 +296,78 @@ void arena_init_prealloc(arena_t *A, void *mem, size_t size);
 void arena_free(arena_t *A);
 
 /*
- * Frees arena without freeing underlying memory.
+ * Frees arena without freeing underlying memory. Growable
+ * arenas keep their largest chunk and free the rest.
  */
 void arena_clear(arena_t *A);
 
 /*
- * Allocates a region of size `size`.
+ * Allocates a region of size `size`, aligned like max_align_t.
  * Returns NULL on failure, or ARENA_NULL
  * if ARENA_NO_STDLIB is defined.
  */
 void *arena_alloc(arena_t *A, size_t size);
 
+/*
+ * Allocates a region of size `size` aligned to `align`,
+ * which must be a power of two. Returns NULL on failure,
+ * or ARENA_NULL if ARENA_NO_STDLIB is defined.
+ */
+void *arena_alloc_aligned(arena_t *A, size_t size, size_t align);
+
+/*
+ * Resizes `ptr`, allocated from `A` with size `old_size`, to
+ * `size`. The most recent allocation is resized in place if
+ * it fits, others are moved unless they shrink. Returns NULL
+ * on failure, or ARENA_NULL if ARENA_NO_STDLIB is defined,
+ * and `ptr` is left as it was.
+ */
+void *arena_realloc(arena_t *A, void *ptr, size_t old_size, size_t size);
+
+/*
+ * Returns a mark of everything allocated from `A` so far.
+ */
+arena_mark_t arena_mark(arena_t *A);
+
+/*
+ * Frees everything allocated from `A` since `mark`, and
+ * the chunks of a growable arena taken after it. Marks
+ * taken after `mark`, and all marks after arena_clear,
+ * are no longer valid.
+ */
+void arena_rewind(arena_t *A, arena_mark_t mark);
+
+#ifndef ARENA_NO_SCRATCH
+/*
+ * Starts using a scratch arena of the calling thread that is
+ * none of the `count` arenas in `conflicts`, such as the arena
+ * the caller allocates its results from when it was given a
+ * scratch arena itself. `arena` is NULL, or ARENA_NULL if
+ * ARENA_NO_STDLIB is defined, on failure.
+ */
+arena_scratch_t arena_scratch_begin(arena_t **conflicts, size_t count);
+
+/*
+ * Frees everything allocated from the scratch arena since
+ * `scratch` was begun. The outermost end keeps only the
+ * largest chunk, so later requests don't need to grow it.
+ * Does nothing for a scratch that failed to begin.
+ */
+void arena_scratch_end(arena_scratch_t scratch);
+#endif
+
+#ifdef ARENA_STATS
+/*
+ * Fills `stats` with the counters of `A`. The high-water
+ * mark is kept across arena_clear and arena_rewind.
+ */
+void arena_stats(arena_t *A, arena_stats_t *stats);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 #ifdef ARENA_IMPLEMENTATION
@@ -83,44 +390,767 @@ void *arena_alloc(arena_t *A, size_t size);
     #define ARENA_NULL NULL
 #endif
 
+#include <assert.h>
+#include <string.h>
+
+#ifndef ARENA_NO_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef ARENA_HUGE_ORDER
+#define ARENA_HUGE_ORDER 21
+#endif
+
+#define ARENA_HUGE_SIZE ((size_t) 1 << ARENA_HUGE_ORDER)
+
+/* a multiple of the page size */
+#ifndef ARENA_COMMIT_SIZE
+#define ARENA_COMMIT_SIZE (1024 * 1024)
+#endif
+#endif
+
+/*
+ * Chunks of growable arenas start with this header,
+ * `mem` points right after it.
+ */
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    _Alignas(max_align_t) uint8_t mem[];
+};
+
+#define CHUNK(ptr) \
+    ((struct arena_chunk *) ((uint8_t *) (ptr) - offsetof(struct arena_chunk, mem)))
+
+#ifdef ARENA_STATS
+#define ARENA_STAT(expr) (expr)
+#else
+#define ARENA_STAT(expr) ((void) 0)
+#endif
+
+#ifndef ARENA_NO_MMAP
+#define ARENA_MAPPED(expr) (expr)
+#else
+#define ARENA_MAPPED(expr) ((void) 0)
+#endif
+
+/*
+ * Commits enough of the mapping of a reserved arena for `bytes`
+ * past `front`, returns 0 if other arenas or the mapping have
+ * no room for them.
+ */
+static int arena_commit(arena_t *A, size_t bytes)
+{
+#ifndef ARENA_NO_MMAP
+    size_t size;
+
+    if (A->mapped <= A->size || bytes > A->mapped - A->front)
+    {
+        return 0;
+    }
+
+    size = A->front + bytes;
+    size = size <= A->mapped - ARENA_COMMIT_SIZE ?
+           (size + ARENA_COMMIT_SIZE - 1) & ~(size_t) (ARENA_COMMIT_SIZE - 1) :
+           A->mapped;
+
+    if (mprotect(A->mem + A->size, size - A->size,
+                 PROT_READ | PROT_WRITE) == -1)
+    {
+        return 0;
+    }
+
+    A->size = size;
+    return 1;
+#else
+    (void) A;
+    (void) bytes;
+    return 0;
+#endif
+}
+
+/*
+ * Counts `allocs` allocations, the last of which ends at `front`.
+ */
+static void arena_count(arena_t *A, size_t allocs)
+{
+#ifdef ARENA_STATS
+    A->allocs += allocs;
+    if (A->prior + A->front > A->peak)
+    {
+        A->peak = A->prior + A->front;
+    }
+#else
+    (void) A;
+    (void) allocs;
+#endif
+}
+
 int arena_init(arena_t *A, size_t size)
 {
     A->front = 0;
     A->size = size;
     A->mem = ARENA_MALLOC(size);
+    A->next_size = 0;
+    ARENA_MAPPED(A->mapped = A->retain = 0);
+    ARENA_MAPPED(A->file = ARENA_NULL);
+    ARENA_STAT(A->allocs = A->prior = A->peak = 0);
     return -(A->mem == ARENA_NULL);
 }
 
+/*
+ * Makes a chunk of at least `size` bytes the current one,
+ * returns 0 on failure.
+ */
+static int arena_grow(arena_t *A, size_t size)
+{
+    struct arena_chunk *chunk;
+
+    if (size < A->next_size)
+    {
+        size = A->next_size;
+    }
+
+    if (size > SIZE_MAX - sizeof(*chunk))
+    {
+        return 0;
+    }
+
+    chunk = ARENA_MALLOC(sizeof(*chunk) + size);
+    if (chunk == ARENA_NULL)
+    {
+        return 0;
+    }
+
+    chunk->size = size;
+    chunk->prev = ARENA_NULL;
+    if (A->mem != ARENA_NULL)
+    {
+        chunk->prev = CHUNK(A->mem);
+        ARENA_STAT(A->prior += A->size);
+    }
+
+    A->mem = chunk->mem;
+    A->size = size;
+    A->front = 0;
+    A->next_size = size <= SIZE_MAX / 2 ? 2 * size : size;
+    return 1;
+}
+
+int arena_init_growable(arena_t *A, size_t size)
+{
+    A->front = 0;
+    A->size = 0;
+    A->mem = ARENA_NULL;
+    A->next_size = size > 0 ? size : 1;
+    ARENA_MAPPED(A->mapped = A->retain = 0);
+    ARENA_MAPPED(A->file = ARENA_NULL);
+    ARENA_STAT(A->allocs = A->prior = A->peak = 0);
+    return -!arena_grow(A, size);
+}
+
 void arena_free(arena_t *A)
 {
+    struct arena_chunk *chunk, *prev;
+
+#ifndef ARENA_NO_MMAP
+    if (A->file != ARENA_NULL)
+    {
+        (void) munmap(A->file, A->mapped + ARENA_FILE_HEADER);
+        A->mapped = 0;
+        A->file = ARENA_NULL;
+    }
+    else if (A->mapped > 0)
+    {
+        (void) munmap(A->mem, A->mapped);
+        A->mapped = 0;
+    }
+    else
+#endif
+    if (A->next_size > 0 && A->mem != ARENA_NULL)
+    {
+        for (chunk = CHUNK(A->mem); chunk != ARENA_NULL; chunk = prev)
+        {
+            prev = chunk->prev;
+            ARENA_FREE(chunk);
+        }
+    }
+    else
+    {
+        ARENA_FREE(A->mem);
+    }
+
     A->size = 0;
     A->front = 0;
-    ARENA_FREE(A->mem);
     A->mem = ARENA_NULL;
+    ARENA_STAT(A->prior = 0);
 }
 
+#ifndef ARENA_NO_MMAP
+int arena_init_huge(arena_t *A, size_t size)
+{
+    uint8_t *mem = MAP_FAILED, *aligned;
+    size_t length;
+
+    if (size > SIZE_MAX - 2 * ARENA_HUGE_SIZE)
+    {
+        return -1;
+    }
+
+    /* the last huge page is not shared with anything else */
+    size = (size + ARENA_HUGE_SIZE - 1) & ~(ARENA_HUGE_SIZE - 1);
+    if (size == 0)
+    {
+        size = ARENA_HUGE_SIZE;
+    }
+
+#ifdef ARENA_HUGETLB
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+               (ARENA_HUGE_ORDER << MAP_HUGE_SHIFT),
+               -1, 0);
+#endif
+
+    if (mem == MAP_FAILED)
+    {
+        /* a huge page more to find an aligned range in,
+         * transparent huge pages need one */
+        length = size + ARENA_HUGE_SIZE;
+        mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            return -1;
+        }
+
+        aligned = (uint8_t *) (((uintptr_t) mem + ARENA_HUGE_SIZE - 1) &
+                               ~(uintptr_t) (ARENA_HUGE_SIZE - 1));
+        if (aligned > mem)
+        {
+            (void) munmap(mem, (size_t) (aligned - mem));
+        }
+        if (aligned + size < mem + length)
+        {
+            (void) munmap(aligned + size,
+                          (size_t) (mem + length - aligned - size));
+        }
+
+        mem = aligned;
+        (void) madvise(mem, size, MADV_HUGEPAGE);
+    }
+
+    A->front = 0;
+    A->size = size;
+    A->mem = mem;
+    A->next_size = 0;
+    A->mapped = size;
+    A->retain = size;
+    A->file = ARENA_NULL;
+    ARENA_STAT(A->allocs = A->prior = A->peak = 0);
+    return 0;
+}
+
+int arena_init_reserved(arena_t *A, size_t reserve, size_t retain)
+{
+    uint8_t *mem;
+
+    if (reserve == 0 || reserve > SIZE_MAX - ARENA_COMMIT_SIZE)
+    {
+        return -1;
+    }
+
+    reserve = (reserve + ARENA_COMMIT_SIZE - 1) &
+              ~(size_t) (ARENA_COMMIT_SIZE - 1);
+    retain = retain < reserve ?
+             (retain + ARENA_COMMIT_SIZE - 1) &
+             ~(size_t) (ARENA_COMMIT_SIZE - 1) :
+             reserve;
+
+    /* private pages without access are not charged, arena_commit
+     * makes them writable and takes the charge, which fails with
+     * ENOMEM when the system has no more to give. MAP_NORESERVE
+     * would exempt them from the charge for good */
+    mem = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    A->front = 0;
+    A->size = 0;
+    A->mem = mem;
+    A->next_size = 0;
+    A->mapped = reserve;
+    A->retain = retain;
+    A->file = ARENA_NULL;
+    ARENA_STAT(A->allocs = A->prior = A->peak = 0);
+    return 0;
+}
+
+/*
+ * The first ARENA_FILE_HEADER bytes of a file arena. `size` is
+ * the length of the file, `front` and `root` are those of the
+ * arena when last synced, the root as an offset.
+ */
+struct arena_file {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t front;
+    uint64_t root;
+};
+
+_Static_assert(sizeof(struct arena_file) <= ARENA_FILE_HEADER,
+               "arena.h: struct arena_file outgrew ARENA_FILE_HEADER");
+
+/* "ARENAFIL" */
+#define ARENA_FILE_MAGIC 0x4c4946414e455241ull
+
+int arena_init_file(arena_t *A, const char *path, size_t size, int mode)
+{
+    struct arena_file *file;
+    struct stat st;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    int fd;
+
+    if (mode == ARENA_FILE_CREATE)
+    {
+        if (size > SIZE_MAX - ARENA_FILE_HEADER - page)
+        {
+            return -1;
+        }
+
+        size = (size + ARENA_FILE_HEADER + page - 1) & ~(page - 1);
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        if (ftruncate(fd, (off_t) size) == -1)
+        {
+            (void) close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        fd = open(path, mode == ARENA_FILE_SHARED ? O_RDWR : O_RDONLY);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        if (fstat(fd, &st) == -1 || st.st_size < ARENA_FILE_HEADER ||
+            (uint64_t) st.st_size > SIZE_MAX)
+        {
+            (void) close(fd);
+            return -1;
+        }
+        size = (size_t) st.st_size;
+    }
+
+    /* the mapping stays when the file is closed */
+    file = mmap(NULL, size,
+                mode == ARENA_FILE_READ ? PROT_READ : PROT_READ | PROT_WRITE,
+                mode == ARENA_FILE_PRIVATE ? MAP_PRIVATE : MAP_SHARED,
+                fd, 0);
+    (void) close(fd);
+    if (file == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if (mode == ARENA_FILE_CREATE)
+    {
+        file->magic = ARENA_FILE_MAGIC;
+        file->size = size;
+        file->front = 0;
+        file->root = 0;
+    }
+    else if (file->magic != ARENA_FILE_MAGIC || file->size != size ||
+             file->front > size - ARENA_FILE_HEADER ||
+             file->root > size)
+    {
+        (void) munmap(file, size);
+        return -1;
+    }
+
+    A->front = (size_t) file->front;
+    A->mem = (uint8_t *) file + ARENA_FILE_HEADER;
+    A->size = mode == ARENA_FILE_READ ? A->front : size - ARENA_FILE_HEADER;
+    A->next_size = 0;
+    /* nothing to decommit, and arena_commit has no room */
+    A->mapped = size - ARENA_FILE_HEADER;
+    A->retain = A->mapped;
+    A->file = file;
+    ARENA_STAT(A->allocs = A->prior = 0);
+    ARENA_STAT(A->peak = A->front);
+    return 0;
+}
+
+int arena_sync(arena_t *A)
+{
+    if (A->file == ARENA_NULL)
+    {
+        return -1;
+    }
+
+    A->file->front = A->front;
+    return msync(A->file, ARENA_FILE_HEADER + A->front, MS_SYNC);
+}
+
+int arena_set_root(arena_t *A, void *ptr)
+{
+    if (A->file == ARENA_NULL)
+    {
+        return -1;
+    }
+
+    A->file->root = arena_offset(A, ptr);
+    return 0;
+}
+
+void *arena_root(arena_t *A)
+{
+    if (A->file == ARENA_NULL)
+    {
+        return ARENA_NULL;
+    }
+
+    return arena_pointer(A, A->file->root);
+}
+
+void arena_pool_init(arena_pool_t *P, size_t block_size)
+{
+    if (block_size < sizeof(uint64_t))
+    {
+        block_size = sizeof(uint64_t);
+    }
+
+    /* arena_alloc aligns the blocks, the size keeps
+     * the offsets in them aligned too */
+    P->block_size = (block_size + sizeof(uint64_t) - 1) &
+                    ~(uint64_t) (sizeof(uint64_t) - 1);
+    P->free = 0;
+}
+
+void *arena_pool_alloc(arena_t *A, arena_pool_t *P)
+{
+    uint64_t *block;
+
+    if (P->free == 0)
+    {
+        return arena_alloc(A, (size_t) P->block_size);
+    }
+
+    block = arena_pointer(A, P->free);
+    P->free = *block;
+    return block;
+}
+
+void arena_pool_free(arena_t *A, arena_pool_t *P, void *ptr)
+{
+    *(uint64_t *) ptr = P->free;
+    P->free = arena_offset(A, ptr);
+}
+
+#endif
+
 void arena_init_prealloc(arena_t *A, void *mem, size_t size)
 {
     A->front = 0;
     A->size = size;
     A->mem = mem;
+    A->next_size = 0;
+    ARENA_MAPPED(A->mapped = A->retain = 0);
+    ARENA_MAPPED(A->file = ARENA_NULL);
+    ARENA_STAT(A->allocs = A->prior = A->peak = 0);
 }
 
 void arena_clear(arena_t *A)
 {
+    struct arena_chunk *chunk, *prev, *largest;
+
     A->front = 0;
+
+#ifndef ARENA_NO_MMAP
+    /* mapping pages without access over the committed ones
+     * gives back both the memory and its commit charge */
+    if (A->mapped > 0 && A->size > A->retain &&
+        mmap(A->mem + A->retain, A->size - A->retain, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+             -1, 0) != MAP_FAILED)
+    {
+        A->size = A->retain;
+    }
+#endif
+
+    if (A->next_size == 0 || A->mem == ARENA_NULL)
+    {
+        return;
+    }
+
+    /* keep the largest chunk so that a steady load
+     * eventually fits in a single one */
+    largest = CHUNK(A->mem);
+    for (chunk = largest->prev; chunk != ARENA_NULL; chunk = chunk->prev)
+    {
+        if (chunk->size > largest->size)
+        {
+            largest = chunk;
+        }
+    }
+
+    for (chunk = CHUNK(A->mem); chunk != ARENA_NULL; chunk = prev)
+    {
+        prev = chunk->prev;
+        if (chunk != largest)
+        {
+            ARENA_FREE(chunk);
+        }
+    }
+
+    largest->prev = ARENA_NULL;
+    A->mem = largest->mem;
+    A->size = largest->size;
+    ARENA_STAT(A->prior = 0);
 }
 
-void *arena_alloc(arena_t *A, size_t size)
+void *arena_alloc_aligned(arena_t *A, size_t size, size_t align)
 {
-    if (A->front + size > A->size)
+    size_t pad;
+
+    if (align == 0 || (align & (align - 1)) != 0)
     {
         return ARENA_NULL;
     }
 
-    void *ptr = &A->mem[A->front];
-    A->front += size;
+    /* bytes to skip for `front` to be aligned */
+    pad = -((uintptr_t) A->mem + A->front) & (align - 1);
+
+    if ((pad > A->size - A->front || size > A->size - A->front - pad) &&
+        (size > SIZE_MAX - pad || !arena_commit(A, pad + size)))
+    {
+        /* chunks are only aligned like max_align_t */
+        if (A->next_size == 0 || size > SIZE_MAX - align ||
+            !arena_grow(A, size + align - 1))
+        {
+            return ARENA_NULL;
+        }
+
+        pad = -(uintptr_t) A->mem & (align - 1);
+    }
+
+    void *ptr = &A->mem[A->front + pad];
+    A->front += pad + size;
+    arena_count(A, 1);
     return ptr;
 }
 
+void *arena_alloc(arena_t *A, size_t size)
+{
+    return arena_alloc_aligned(A, size, _Alignof(max_align_t));
+}
+
+void *arena_realloc(arena_t *A, void *ptr, size_t old_size, size_t size)
+{
+    uint8_t *new_ptr;
+
+    if (ptr == ARENA_NULL)
+    {
+        return arena_alloc(A, size);
+    }
+
+    /* the most recent allocation ends at front, and reserved
+     * arenas may commit more to grow it in place */
+    if ((uint8_t *) ptr + old_size == &A->mem[A->front] &&
+        (size <= A->size - ((uint8_t *) ptr - A->mem) ||
+         arena_commit(A, size - old_size)))
+    {
+        A->front = (size_t) ((uint8_t *) ptr - A->mem) + size;
+        arena_count(A, 0);
+        return ptr;
+    }
+
+    if (size <= old_size)
+    {
+        return ptr;
+    }
+
+    new_ptr = arena_alloc(A, size);
+    if (new_ptr == ARENA_NULL)
+    {
+        return ARENA_NULL;
+    }
+
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+arena_mark_t arena_mark(arena_t *A)
+{
+    arena_mark_t mark;
+    mark.mem = A->mem;
+    mark.front = A->front;
+    return mark;
+}
+
+void arena_rewind(arena_t *A, arena_mark_t mark)
+{
+    struct arena_chunk *chunk;
+
+    /* free the chunks chained after the mark, which must
+     * not be past the first */
+    while (A->mem != mark.mem && A->next_size > 0 &&
+           CHUNK(A->mem)->prev != ARENA_NULL)
+    {
+        chunk = CHUNK(A->mem);
+        A->mem = chunk->prev->mem;
+        A->size = chunk->prev->size;
+        A->next_size = A->size <= SIZE_MAX / 2 ? 2 * A->size : A->size;
+        ARENA_STAT(A->prior -= A->size);
+        ARENA_FREE(chunk);
+    }
+
+    assert(A->mem == mark.mem && "arena_rewind: not a mark of this arena");
+    A->front = mark.front;
+}
+
+#ifdef ARENA_STATS
+void arena_stats(arena_t *A, arena_stats_t *stats)
+{
+    struct arena_chunk *chunk;
+
+    stats->allocs = A->allocs;
+    stats->used = A->prior + A->front;
+    stats->peak = A->peak;
+    stats->reserved = A->prior + A->size;
+    stats->chunks = A->mem != ARENA_NULL;
+
+    if (A->next_size > 0 && A->mem != ARENA_NULL)
+    {
+        stats->chunks = 0;
+        for (chunk = CHUNK(A->mem); chunk != ARENA_NULL; chunk = chunk->prev)
+        {
+            stats->chunks++;
+        }
+    }
+}
+#endif
+
+#ifndef ARENA_NO_SCRATCH
+
+#include <pthread.h>
+
+#ifndef ARENA_SCRATCH_COUNT
+#define ARENA_SCRATCH_COUNT 2
+#endif
+
+/* the first chunk of each scratch arena */
+#ifndef ARENA_SCRATCH_SIZE
+#define ARENA_SCRATCH_SIZE (64 * 1024)
+#endif
+
+static _Thread_local arena_t scratch_arenas[ARENA_SCRATCH_COUNT];
+/* the number of begun scratches of each arena */
+static _Thread_local size_t scratch_depth[ARENA_SCRATCH_COUNT];
+/* frees the scratch arenas of exiting threads */
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *arg)
+{
+    (void) arg;
+
+    for (size_t i = 0; i < ARENA_SCRATCH_COUNT; i++)
+    {
+        if (scratch_arenas[i].mem != ARENA_NULL)
+        {
+            arena_free(&scratch_arenas[i]);
+        }
+    }
+}
+
+static void scratch_create_key(void)
+{
+    (void) pthread_key_create(&scratch_key, scratch_free);
+}
+
+static int scratch_conflicts(arena_t *A, arena_t **conflicts, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (conflicts[i] == A)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+arena_scratch_t arena_scratch_begin(arena_t **conflicts, size_t count)
+{
+    arena_scratch_t scratch;
+    arena_t *A = ARENA_NULL;
+    size_t i;
+
+    scratch.arena = ARENA_NULL;
+
+    for (i = 0; i < ARENA_SCRATCH_COUNT; i++)
+    {
+        A = &scratch_arenas[i];
+        if (!scratch_conflicts(A, conflicts, count))
+        {
+            break;
+        }
+    }
+
+    if (i == ARENA_SCRATCH_COUNT)
+    {
+        return scratch;
+    }
+
+    if (A->mem == ARENA_NULL)
+    {
+        if (arena_init_growable(A, ARENA_SCRATCH_SIZE) == -1)
+        {
+            return scratch;
+        }
+
+        /* the value only has to be non-null
+         * for the destructor to run */
+        pthread_once(&scratch_once, scratch_create_key);
+        (void) pthread_setspecific(scratch_key, scratch_arenas);
+    }
+
+    scratch_depth[i]++;
+    scratch.arena = A;
+    scratch.mark = arena_mark(A);
+    return scratch;
+}
+
+void arena_scratch_end(arena_scratch_t scratch)
+{
+    size_t i;
+
+    /* arena_scratch_begin failed */
+    if (scratch.arena == ARENA_NULL)
+    {
+        return;
+    }
+
+    i = (size_t) (scratch.arena - scratch_arenas);
+    if (--scratch_depth[i] == 0)
+    {
+        arena_clear(scratch.arena);
+    }
+    else
+    {
+        arena_rewind(scratch.arena, scratch.mark);
+    }
+}
+
+#endif
+
 #endif
@@ -0,0 +1,1258 @@
+// Allocator microbenchmarks, see README.md
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <search.h>
+#include <sys/resource.h>
+
+#define BUDDY_IMPLEMENTATION
+#include "../buddy.h"
+
+#define POOL_IMPLEMENTATION
+#include "../pool.h"
+
+#define ARENA_NO_SCRATCH
+#define ARENA_IMPLEMENTATION
+#include "../arena.h"
+
+enum { FIXED, RANDOM, XTHREAD, REALLOC, MIX, REPLAY, NWORKLOADS };
+
+static const char *workload_names[NWORKLOADS] = {
+    "fixed", "random", "xthread", "realloc", "mix", "replay",
+};
+
+// the size of the objects of the fixed workload
+#define FIXED_SIZE 64
+// objects allocated before they are all freed, in fixed and random
+#define BATCH 1024
+// largest object of the random workload
+#define RANDOM_MAX 1024
+// the live set the mix workload keeps, and its largest object
+#define MIX_LIVE (64 << 20)
+#define MIX_MAX (256 << 10)
+// vectors grown at once by the realloc workload, and their final size
+#define VECTORS 8
+#define VECTOR_MAX (64 << 10)
+// slots of the queue between producers and consumers
+#define QUEUE 1024
+// time one in SAMPLE operations
+#define SAMPLE 32
+// the most times the replay workload measures the resident memory
+#define MAX_SAMPLES 4096
+
+// an allocator under test. `state` is per thread, made by
+// `thread_init` for objects of `size` bytes, or any size if 0,
+// and `reset` is called whenever everything in it was freed
+struct backend {
+    const char *name;
+    unsigned workloads;
+    void *(*thread_init)(size_t size);
+    void (*thread_done)(void *state);
+    void *(*alloc)(void *state, size_t size);
+    void (*free)(void *state, void *ptr, size_t size);
+    void *(*realloc)(void *state, void *ptr, size_t old_size, size_t size);
+    void (*reset)(void *state);
+};
+
+// latency histogram, 8 buckets per power of two nanoseconds
+#define BUCKETS (64 * 8)
+
+// what the histograms of a thread are kept for
+enum { OP_ALLOC, OP_FREE, OP_REALLOC, NOPS };
+
+static const char *op_names[NOPS] = { "alloc", "free", "realloc" };
+
+struct thread {
+    pthread_t thread;
+    unsigned id;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t hist[NOPS][BUCKETS];
+    void *state;
+};
+
+static const struct backend *backend;
+static int workload;
+static unsigned nthreads = 1;
+static uint64_t nops = 2000000;
+// operations of the replay between measuring the resident memory
+static uint64_t interval;
+
+// everyone stops at the checkpoint with the most memory in use,
+// where thread 0 measures the resident size
+static pthread_barrier_t barrier;
+static size_t live_bytes;
+static size_t base_rss;
+static size_t checkpoint_rss;
+static size_t checkpoint_live;
+
+static void *no_state(size_t size)
+{
+    (void) size;
+    return NULL;
+}
+
+static void no_done(void *state)
+{
+    (void) state;
+}
+
+static void no_reset(void *state)
+{
+    (void) state;
+}
+
+static void *malloc_alloc(void *state, size_t size)
+{
+    (void) state;
+    return malloc(size);
+}
+
+static void malloc_free(void *state, void *ptr, size_t size)
+{
+    (void) state;
+    (void) size;
+    free(ptr);
+}
+
+static void *malloc_realloc(void *state, void *ptr, size_t old_size,
+                            size_t size)
+{
+    (void) state;
+    (void) old_size;
+    return realloc(ptr, size);
+}
+
+static void *buddy_alloc(void *state, size_t size)
+{
+    (void) state;
+    return balloc(size);
+}
+
+static void buddy_free(void *state, void *ptr, size_t size)
+{
+    (void) state;
+    (void) size;
+    bfree(ptr);
+}
+
+static void *buddy_realloc(void *state, void *ptr, size_t old_size,
+                           size_t size)
+{
+    (void) state;
+    (void) old_size;
+    return brealloc(ptr, size);
+}
+
+static void *pool_state(size_t size)
+{
+    pool_t *P = malloc(sizeof(*P));
+
+    if (P == NULL || pool_init(P, size, PNULL) == -1)
+    {
+        fprintf(stderr, "bench: pool_init failed\n");
+        exit(1);
+    }
+
+    return P;
+}
+
+static void pool_done(void *state)
+{
+    pool_destroy(state);
+    free(state);
+}
+
+static void *pool_alloc_any(void *state, size_t size)
+{
+    (void) size;
+    return pool_alloc(state);
+}
+
+static void pool_free_any(void *state, void *ptr, size_t size)
+{
+    (void) size;
+    pool_free(state, ptr);
+}
+
+static void *arena_state(size_t size)
+{
+    arena_t *A = malloc(sizeof(*A));
+
+    (void) size;
+    if (A == NULL || arena_init_growable(A, 64 * 1024) == -1)
+    {
+        fprintf(stderr, "bench: arena_init_growable failed\n");
+        exit(1);
+    }
+
+    return A;
+}
+
+static void arena_done(void *state)
+{
+    arena_free(state);
+    free(state);
+}
+
+static void *arena_alloc_any(void *state, size_t size)
+{
+    return arena_alloc(state, size);
+}
+
+// arenas free everything at once in `reset`
+static void arena_free_any(void *state, void *ptr, size_t size)
+{
+    (void) state;
+    (void) ptr;
+    (void) size;
+}
+
+static void *arena_realloc_any(void *state, void *ptr, size_t old_size,
+                               size_t size)
+{
+    return arena_realloc(state, ptr, old_size, size);
+}
+
+static void arena_reset(void *state)
+{
+    arena_clear(state);
+}
+
+#define ALL ((1u << NWORKLOADS) - 1)
+
+static const struct backend backends[] = {
+    // with LD_PRELOAD, this is whatever malloc was preloaded
+    {
+        "malloc", ALL, no_state, no_done,
+        malloc_alloc, malloc_free, malloc_realloc, no_reset,
+    },
+    {
+        "buddy", ALL, no_state, no_done,
+        buddy_alloc, buddy_free, buddy_realloc, no_reset,
+    },
+    {
+        "pool", 1u << FIXED, pool_state, pool_done,
+        pool_alloc_any, pool_free_any, NULL, no_reset,
+    },
+    {
+        "arena", 1u << FIXED | 1u << RANDOM | 1u << REALLOC,
+        arena_state, arena_done,
+        arena_alloc_any, arena_free_any, arena_realloc_any, arena_reset,
+    },
+};
+
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t next_random(struct thread *t)
+{
+    // xorshift64
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return t->rng;
+}
+
+// sizes spread evenly over the powers of two from 16 to `max`,
+// so small objects are much more common than large ones
+static size_t random_size(struct thread *t, size_t max)
+{
+    unsigned orders = (unsigned) (63 - __builtin_clzll(max)) - 3;
+    uint64_t r = next_random(t);
+    size_t low = (size_t) 16 << (r % orders);
+    size_t size = low + (size_t) (r >> 32) % low;
+
+    return size < max ? size : max;
+}
+
+static unsigned bucket_of(uint64_t ns)
+{
+    unsigned e;
+
+    if (ns < 8)
+    {
+        return (unsigned) ns;
+    }
+
+    e = (unsigned) (63 - __builtin_clzll(ns));
+    return (e - 2) * 8 + (unsigned) ((ns >> (e - 3)) & 7);
+}
+
+static uint64_t bucket_value(unsigned bucket)
+{
+    unsigned e = bucket / 8 + 2;
+
+    if (bucket < 8)
+    {
+        return bucket;
+    }
+
+    return ((uint64_t) 1 << e) + ((uint64_t) (bucket % 8) << (e - 3));
+}
+
+// write to every page of bytes `from` to `size`, like a program
+// would, so it is resident when measured
+static void touch(void *ptr, size_t from, size_t size)
+{
+    for (size_t i = from; i < size; i += 4096)
+    {
+        ((volatile char *) ptr)[i] = 1;
+    }
+
+    if (size > from)
+    {
+        ((volatile char *) ptr)[size - 1] = 1;
+    }
+}
+
+static void *timed_alloc(struct thread *t, size_t size)
+{
+    uint64_t start;
+    void *ptr;
+
+    if (++t->ops % SAMPLE != 0)
+    {
+        ptr = backend->alloc(t->state, size);
+    }
+    else
+    {
+        start = now_ns();
+        ptr = backend->alloc(t->state, size);
+        t->hist[OP_ALLOC][bucket_of(now_ns() - start)]++;
+    }
+
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    touch(ptr, 0, size);
+    return ptr;
+}
+
+static void timed_free(struct thread *t, void *ptr, size_t size)
+{
+    uint64_t start;
+
+    if (++t->ops % SAMPLE != 0)
+    {
+        backend->free(t->state, ptr, size);
+        return;
+    }
+
+    start = now_ns();
+    backend->free(t->state, ptr, size);
+    t->hist[OP_FREE][bucket_of(now_ns() - start)]++;
+}
+
+static void *timed_realloc(struct thread *t, void *ptr, size_t old_size,
+                           size_t size)
+{
+    uint64_t start;
+
+    if (++t->ops % SAMPLE != 0)
+    {
+        ptr = backend->realloc(t->state, ptr, old_size, size);
+    }
+    else
+    {
+        start = now_ns();
+        ptr = backend->realloc(t->state, ptr, old_size, size);
+        t->hist[OP_REALLOC][bucket_of(now_ns() - start)]++;
+    }
+
+    if (ptr == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    touch(ptr, old_size, size);
+    return ptr;
+}
+
+static size_t resident_bytes(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0;
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2)
+    {
+        resident = 0;
+    }
+
+    fclose(file);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+// called by every thread once, with `live` bytes in use
+static void checkpoint(struct thread *t, size_t live)
+{
+    (void) __atomic_fetch_add(&live_bytes, live, __ATOMIC_RELAXED);
+    pthread_barrier_wait(&barrier);
+
+    if (t->id == 0)
+    {
+        checkpoint_rss = resident_bytes();
+        checkpoint_live = live_bytes;
+    }
+
+    pthread_barrier_wait(&barrier);
+}
+
+static void run_fixed(struct thread *t)
+{
+    void *ptrs[BATCH];
+    uint64_t rounds = nops / (2 * BATCH);
+
+    for (uint64_t round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < BATCH; i++)
+        {
+            ptrs[i] = timed_alloc(t, FIXED_SIZE);
+        }
+
+        if (round == rounds / 2)
+        {
+            checkpoint(t, BATCH * FIXED_SIZE);
+        }
+
+        for (size_t i = 0; i < BATCH; i++)
+        {
+            timed_free(t, ptrs[i], FIXED_SIZE);
+        }
+
+        backend->reset(t->state);
+    }
+}
+
+static void run_random(struct thread *t)
+{
+    void *ptrs[BATCH] = { NULL };
+    size_t sizes[BATCH];
+    uint64_t rounds = nops / (4 * BATCH);
+    size_t live = 0;
+
+    for (uint64_t round = 0; round < rounds; round++)
+    {
+        // free and allocate in random slots, then free the rest
+        for (size_t i = 0; i < 4 * BATCH - BATCH; i++)
+        {
+            size_t slot = next_random(t) % BATCH;
+
+            if (ptrs[slot] != NULL)
+            {
+                timed_free(t, ptrs[slot], sizes[slot]);
+                ptrs[slot] = NULL;
+                live -= sizes[slot];
+            }
+            else
+            {
+                sizes[slot] = random_size(t, RANDOM_MAX);
+                ptrs[slot] = timed_alloc(t, sizes[slot]);
+                live += sizes[slot];
+            }
+        }
+
+        if (round == rounds / 2)
+        {
+            checkpoint(t, live);
+        }
+
+        for (size_t i = 0; i < BATCH; i++)
+        {
+            if (ptrs[i] != NULL)
+            {
+                timed_free(t, ptrs[i], sizes[i]);
+                ptrs[i] = NULL;
+            }
+        }
+
+        live = 0;
+        backend->reset(t->state);
+    }
+}
+
+// a queue from each even thread to the odd one after it
+struct queue {
+    _Alignas(64) size_t head;
+    _Alignas(64) size_t tail;
+    void *slots[QUEUE];
+};
+
+static struct queue *queues;
+
+static void run_xthread(struct thread *t)
+{
+    struct queue *q = &queues[t->id / 2];
+    uint64_t count = nops / 2;
+    size_t head, tail;
+    void *ptr;
+
+    checkpoint(t, 0);
+
+    if (t->id % 2 == 0)
+    {
+        // produce
+        for (uint64_t i = 0; i < count; i++)
+        {
+            ptr = timed_alloc(t, random_size(t, RANDOM_MAX));
+            tail = q->tail;
+            while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE)
+            {
+                sched_yield();
+            }
+            q->slots[tail % QUEUE] = ptr;
+            __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        return;
+    }
+
+    // consume
+    for (uint64_t i = 0; i < count; i++)
+    {
+        head = q->head;
+        while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head)
+        {
+            sched_yield();
+        }
+        ptr = q->slots[head % QUEUE];
+        __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+        timed_free(t, ptr, 0);
+    }
+}
+
+static void run_realloc(struct thread *t)
+{
+    void *ptrs[VECTORS] = { NULL };
+    size_t sizes[VECTORS] = { 0 };
+    size_t size;
+    int half = 0;
+
+    while (t->ops < nops)
+    {
+        // grow the vectors in turn, so they are not all
+        // at the top of the heap
+        for (size_t i = 0; i < VECTORS; i++)
+        {
+            size = sizes[i] + sizes[i] / 2 + 16;
+            ptrs[i] = timed_realloc(t, ptrs[i], sizes[i], size);
+            sizes[i] = size;
+        }
+
+        if (sizes[0] < VECTOR_MAX)
+        {
+            continue;
+        }
+
+        if (!half && t->ops >= nops / 2)
+        {
+            size = 0;
+            for (size_t i = 0; i < VECTORS; i++)
+            {
+                size += sizes[i];
+            }
+            checkpoint(t, size);
+            half = 1;
+        }
+
+        for (size_t i = 0; i < VECTORS; i++)
+        {
+            timed_free(t, ptrs[i], sizes[i]);
+            ptrs[i] = NULL;
+            sizes[i] = 0;
+        }
+
+        backend->reset(t->state);
+    }
+
+    if (!half)
+    {
+        checkpoint(t, 0);
+    }
+
+    for (size_t i = 0; i < VECTORS; i++)
+    {
+        if (ptrs[i] != NULL)
+        {
+            timed_free(t, ptrs[i], sizes[i]);
+        }
+    }
+}
+
+static void run_mix(struct thread *t)
+{
+    size_t target = MIX_LIVE / nthreads;
+    size_t count = target / 1024;
+    void **ptrs = calloc(count, sizeof(*ptrs));
+    size_t *sizes = calloc(count, sizeof(*sizes));
+    size_t live = 0, slot;
+
+    if (ptrs == NULL || sizes == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    // replace random objects while keeping about `target`
+    // bytes live, so the heap fragments
+    while (t->ops < nops)
+    {
+        slot = next_random(t) % count;
+
+        if (ptrs[slot] != NULL && (live > target || next_random(t) % 2))
+        {
+            timed_free(t, ptrs[slot], sizes[slot]);
+            live -= sizes[slot];
+            ptrs[slot] = NULL;
+        }
+        else if (ptrs[slot] == NULL && live <= target)
+        {
+            sizes[slot] = random_size(t, MIX_MAX);
+            ptrs[slot] = timed_alloc(t, sizes[slot]);
+            live += sizes[slot];
+        }
+    }
+
+    checkpoint(t, live);
+
+    for (slot = 0; slot < count; slot++)
+    {
+        if (ptrs[slot] != NULL)
+        {
+            timed_free(t, ptrs[slot], sizes[slot]);
+        }
+    }
+
+    free(ptrs);
+    free(sizes);
+}
+
+// a parsed trace, see README.md
+struct event {
+    char op;
+    size_t id;
+    size_t size;
+};
+
+static struct event *events;
+static size_t nevents;
+static size_t max_id;
+
+// resident and live memory measured by the replay every `interval`
+struct sample {
+    uint64_t ops;
+    size_t rss;
+    size_t live;
+};
+
+static struct sample samples[MAX_SAMPLES];
+static size_t nsamples;
+
+static void add_event(char op, size_t id, size_t size)
+{
+    static size_t capacity;
+
+    if (nevents == capacity)
+    {
+        capacity = capacity ? 2 * capacity : 4096;
+        events = realloc(events, capacity * sizeof(*events));
+        if (events == NULL)
+        {
+            fprintf(stderr, "bench: out of memory\n");
+            exit(1);
+        }
+    }
+
+    events[nevents].op = op;
+    events[nevents].id = id;
+    events[nevents].size = size;
+    nevents++;
+
+    if (id > max_id)
+    {
+        max_id = id;
+    }
+}
+
+static void load_text_trace(FILE *file, const char *path)
+{
+    struct event event;
+    char line[256];
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        event.size = 0;
+        if (line[0] == '#' || line[0] == '\n')
+        {
+            continue;
+        }
+
+        if (sscanf(line, " %c %zu %zu", &event.op, &event.id,
+                   &event.size) < 2 ||
+            strchr("afr", event.op) == NULL ||
+            (event.op != 'f' && event.size == 0))
+        {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            exit(1);
+        }
+
+        add_event(event.op, event.id, event.size);
+    }
+}
+
+// memory live in a BUDDY_TRACE trace, by its address
+struct live {
+    uint64_t ptr;
+    size_t id;
+};
+
+static void *live_tree;
+static size_t next_id;
+
+static int compare_live(const void *a, const void *b)
+{
+    uint64_t x = ((const struct live *) a)->ptr;
+    uint64_t y = ((const struct live *) b)->ptr;
+
+    return (x > y) - (x < y);
+}
+
+// the live memory at `ptr`, or NULL
+static struct live *find_live(uint64_t ptr)
+{
+    struct live key = { ptr, 0 };
+    struct live **found = tfind(&key, &live_tree, compare_live);
+
+    return found == NULL ? NULL : *found;
+}
+
+static void remove_live(struct live *live)
+{
+    (void) tdelete(live, &live_tree, compare_live);
+    free(live);
+}
+
+// object `id` is now at `ptr`. two threads racing for the same
+// memory may have recorded its allocation before its free, in
+// which case the object there before is freed here instead
+static void insert_live(uint64_t ptr, size_t id)
+{
+    struct live *live = find_live(ptr);
+
+    if (live != NULL)
+    {
+        add_event('f', live->id, 0);
+        remove_live(live);
+    }
+
+    live = malloc(sizeof(*live));
+    if (live == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    live->ptr = ptr;
+    live->id = id;
+    if (tsearch(live, &live_tree, compare_live) == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+}
+
+static void add_live(uint64_t ptr, size_t size)
+{
+    insert_live(ptr, next_id);
+    add_event('a', next_id++, size ? size : 1);
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const buddy_trace_record_t *x = a, *y = b;
+
+    if (x->time != y->time)
+    {
+        return x->time > y->time ? 1 : -1;
+    }
+
+    return (x->thread > y->thread) - (x->thread < y->thread);
+}
+
+// turn the records of all threads into events of one, in the
+// order they happened. memory allocated before tracing started
+// isn't in the trace, so frees of it are left out
+static void load_binary_trace(FILE *file, const char *path)
+{
+    buddy_trace_record_t *records = NULL, *record;
+    size_t count = 0, capacity = 0, got, id;
+    struct live *live;
+
+    for (;;)
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 4096;
+            records = realloc(records, capacity * sizeof(*records));
+            if (records == NULL)
+            {
+                fprintf(stderr, "bench: out of memory\n");
+                exit(1);
+            }
+        }
+
+        got = fread(records + count, sizeof(*records), capacity - count,
+                    file);
+        count += got;
+        if (count < capacity)
+        {
+            break;
+        }
+    }
+
+    if (ferror(file))
+    {
+        perror(path);
+        exit(1);
+    }
+
+    qsort(records, count, sizeof(*records), compare_records);
+
+    for (record = records; record < records + count; record++)
+    {
+        live = record->op == BUDDY_TRACE_ALLOC ? NULL :
+               find_live(record->op == BUDDY_TRACE_FREE ?
+                         record->ptr : record->old_ptr);
+
+        switch (record->op)
+        {
+        case BUDDY_TRACE_ALLOC:
+            if (record->ptr != 0)
+            {
+                add_live(record->ptr, record->size);
+            }
+            break;
+        case BUDDY_TRACE_FREE:
+            if (live != NULL)
+            {
+                add_event('f', live->id, 0);
+                remove_live(live);
+            }
+            break;
+        case BUDDY_TRACE_REALLOC:
+            if (record->ptr == 0)
+            {
+                // freed by a size of 0, or failed and left as it was
+                if (record->size == 0 && live != NULL)
+                {
+                    add_event('f', live->id, 0);
+                    remove_live(live);
+                }
+            }
+            else if (live == NULL)
+            {
+                add_live(record->ptr, record->size);
+            }
+            else
+            {
+                // the object keeps its id where it moved to
+                id = live->id;
+                if (record->ptr != record->old_ptr)
+                {
+                    remove_live(live);
+                    insert_live(record->ptr, id);
+                }
+                add_event('r', id, record->size);
+            }
+            break;
+        default:
+            fprintf(stderr, "%s: bad record\n", path);
+            exit(1);
+        }
+    }
+
+    tdestroy(live_tree, free);
+    live_tree = NULL;
+    free(records);
+}
+
+// either format, told apart by BUDDY_TRACE_MAGIC
+static void load_trace(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    uint64_t magic = 0;
+
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    if (fread(&magic, sizeof(magic), 1, file) == 1 &&
+        magic == BUDDY_TRACE_MAGIC)
+    {
+        load_binary_trace(file, path);
+    }
+    else
+    {
+        rewind(file);
+        load_text_trace(file, path);
+    }
+
+    fclose(file);
+}
+
+static void run_replay(struct thread *t)
+{
+    void **ptrs = calloc(max_id + 1, sizeof(*ptrs));
+    size_t *sizes = calloc(max_id + 1, sizeof(*sizes));
+    size_t live = 0, peak = 0, at_peak = 0;
+    struct event *event;
+
+    if (ptrs == NULL || sizes == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+
+    // find where the most is live, to measure there
+    for (size_t i = 0; i < nevents; i++)
+    {
+        event = &events[i];
+        live -= event->op == 'a' ? 0 : sizes[event->id];
+        sizes[event->id] = event->op == 'f' ? 0 : event->size;
+        live += sizes[event->id];
+        if (live > peak)
+        {
+            peak = live;
+            at_peak = i;
+        }
+    }
+
+    memset(sizes, 0, (max_id + 1) * sizeof(*sizes));
+    live = 0;
+
+    for (size_t i = 0; i < nevents; i++)
+    {
+        event = &events[i];
+
+        switch (event->op)
+        {
+        case 'a':
+            ptrs[event->id] = timed_alloc(t, event->size);
+            break;
+        case 'f':
+            timed_free(t, ptrs[event->id], sizes[event->id]);
+            ptrs[event->id] = NULL;
+            break;
+        case 'r':
+            ptrs[event->id] = timed_realloc(t, ptrs[event->id],
+                                            sizes[event->id], event->size);
+            break;
+        }
+
+        live -= event->op == 'a' ? 0 : sizes[event->id];
+        sizes[event->id] = event->op == 'f' ? 0 : event->size;
+        live += sizes[event->id];
+
+        if (i == at_peak)
+        {
+            checkpoint(t, live);
+        }
+
+        if (interval != 0 && (i + 1) % interval == 0 &&
+            nsamples < MAX_SAMPLES)
+        {
+            samples[nsamples].ops = i + 1;
+            samples[nsamples].rss = resident_bytes();
+            samples[nsamples].live = live;
+            nsamples++;
+        }
+    }
+
+    for (size_t id = 0; id <= max_id; id++)
+    {
+        if (ptrs[id] != NULL)
+        {
+            timed_free(t, ptrs[id], sizes[id]);
+        }
+    }
+
+    free(ptrs);
+    free(sizes);
+}
+
+static void *run_thread(void *arg)
+{
+    struct thread *t = arg;
+
+    t->state = backend->thread_init(workload == FIXED ? FIXED_SIZE : 0);
+
+    switch (workload)
+    {
+    case FIXED:
+        run_fixed(t);
+        break;
+    case RANDOM:
+        run_random(t);
+        break;
+    case XTHREAD:
+        run_xthread(t);
+        break;
+    case REALLOC:
+        run_realloc(t);
+        break;
+    case MIX:
+        run_mix(t);
+        break;
+    case REPLAY:
+        run_replay(t);
+        break;
+    }
+
+    backend->thread_done(t->state);
+    return NULL;
+}
+
+static uint64_t percentile(const uint64_t *hist, double p)
+{
+    uint64_t total = 0, sum = 0;
+
+    for (unsigned i = 0; i < BUCKETS; i++)
+    {
+        total += hist[i];
+    }
+
+    for (unsigned i = 0; i < BUCKETS; i++)
+    {
+        sum += hist[i];
+        if (sum > 0 && (double) sum >= p * (double) total)
+        {
+            return bucket_value(i);
+        }
+    }
+
+    return bucket_value(BUCKETS - 1);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: bench [-H] [-a allocator] [-w workload] [-t threads]\n"
+            "             [-n ops] [-N name] [-i interval] [trace]\n"
+            "allocators: malloc buddy pool arena\n"
+            "workloads: fixed random xthread realloc mix replay\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = NULL;
+    uint64_t hist[NOPS][BUCKETS] = { { 0 } }, all[BUCKETS] = { 0 };
+    uint64_t ops = 0, start, elapsed;
+    struct thread *threads;
+    struct rusage usage_after;
+    unsigned count, i;
+    int opt;
+
+    backend = &backends[0];
+
+    while ((opt = getopt(argc, argv, "Ha:w:t:n:N:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            printf("%-8s %-10s %7s %9s %7s %7s %7s %10s %10s %6s\n",
+                   "workload", "allocator", "threads", "Mops/s",
+                   "p50ns", "p99ns", "p999ns", "rss_KiB", "maxrss_KiB",
+                   "frag");
+            return 0;
+        case 'a':
+            for (i = 0; i < NBACKENDS; i++)
+            {
+                if (strcmp(optarg, backends[i].name) == 0)
+                {
+                    break;
+                }
+            }
+            if (i == NBACKENDS)
+            {
+                usage();
+            }
+            backend = &backends[i];
+            break;
+        case 'w':
+            for (workload = 0; workload < NWORKLOADS; workload++)
+            {
+                if (strcmp(optarg, workload_names[workload]) == 0)
+                {
+                    break;
+                }
+            }
+            if (workload == NWORKLOADS)
+            {
+                usage();
+            }
+            break;
+        case 't':
+            nthreads = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            nops = strtoull(optarg, NULL, 10);
+            break;
+        case 'N':
+            name = optarg;
+            break;
+        case 'i':
+            interval = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (nthreads == 0 || nops == 0)
+    {
+        usage();
+    }
+
+    if (!(backend->workloads & 1u << workload))
+    {
+        // not meaningful, like freeing single objects of an arena
+        return 0;
+    }
+
+    if (workload == REPLAY)
+    {
+        if (optind >= argc)
+        {
+            usage();
+        }
+        load_trace(argv[optind]);
+        nthreads = 1;
+    }
+
+    // each producer has a consumer
+    count = workload == XTHREAD ? 2 * nthreads : nthreads;
+    threads = calloc(count, sizeof(*threads));
+    queues = calloc(nthreads, sizeof(*queues));
+    if (threads == NULL || queues == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, count);
+    base_rss = resident_bytes();
+    start = now_ns();
+
+    for (i = 0; i < count; i++)
+    {
+        threads[i].id = i;
+        threads[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+        for (unsigned op = 0; op < NOPS; op++)
+        {
+            for (unsigned b = 0; b < BUCKETS; b++)
+            {
+                hist[op][b] += threads[i].hist[op][b];
+                all[b] += threads[i].hist[op][b];
+            }
+        }
+    }
+
+    elapsed = now_ns() - start;
+    getrusage(RUSAGE_SELF, &usage_after);
+
+    printf("%-8s %-10s %7u %9.2f %7llu %7llu %7llu %10zu %10ld ",
+           workload_names[workload], name ? name : backend->name,
+           count, (double) ops * 1000 / (double) elapsed,
+           (unsigned long long) percentile(all, 0.5),
+           (unsigned long long) percentile(all, 0.99),
+           (unsigned long long) percentile(all, 0.999),
+           checkpoint_rss > base_rss ? (checkpoint_rss - base_rss) / 1024 : 0,
+           usage_after.ru_maxrss);
+
+    // resident memory per live byte at the checkpoint
+    if (checkpoint_live > 0)
+    {
+        printf("%6.2f\n", (double) (checkpoint_rss - base_rss) /
+                          (double) checkpoint_live);
+    }
+    else
+    {
+        printf("%6s\n", "-");
+    }
+
+    if (workload != REPLAY)
+    {
+        return 0;
+    }
+
+    // the latency of each kind of operation, and with -i the
+    // memory over time, commented out of the table
+    for (unsigned op = 0; op < NOPS; op++)
+    {
+        uint64_t timed = 0;
+
+        for (unsigned b = 0; b < BUCKETS; b++)
+        {
+            timed += hist[op][b];
+        }
+        if (timed == 0)
+        {
+            continue;
+        }
+        printf("# %-8s %7llu p50ns %7llu p99ns %7llu p999ns\n", op_names[op],
+               (unsigned long long) percentile(hist[op], 0.5),
+               (unsigned long long) percentile(hist[op], 0.99),
+               (unsigned long long) percentile(hist[op], 0.999));
+    }
+
+    for (size_t s = 0; s < nsamples; s++)
+    {
+        printf("# %12llu ops %10zu rss_KiB %10zu live_KiB",
+               (unsigned long long) samples[s].ops,
+               samples[s].rss > base_rss ?
+                   (samples[s].rss - base_rss) / 1024 : 0,
+               samples[s].live / 1024);
+        if (samples[s].live > 0 && samples[s].rss > base_rss)
+        {
+            printf(" %6.2f frag\n", (double) (samples[s].rss - base_rss) /
+                                    (double) samples[s].live);
+        }
+        else
+        {
+            printf(" %6s frag\n", "-");
+        }
+    }
+
+    return 0;
+}
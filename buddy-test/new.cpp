@@ -0,0 +1,184 @@
+// operator new and delete on top of the malloc family of buddy.h,
+// so C++ programs use its heap too, and sized deletes skip the
+// lookup of the block size
+
+#define BUDDY_STDLIB_OVERRIDE
+#include "../buddy.h"
+
+#include <new>
+
+static void *allocate(std::size_t size)
+{
+    void *ptr;
+
+    // malloc(0) returns BNULL, but new must return an object
+    while ((ptr = malloc(size > 0 ? size : 1)) == BNULL)
+    {
+        std::new_handler handler = std::get_new_handler();
+
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        handler();
+    }
+
+    return ptr;
+}
+
+static void *allocate(std::size_t size, std::align_val_t align)
+{
+    void *ptr;
+
+    while ((ptr = aligned_alloc(static_cast<std::size_t>(align),
+                                size > 0 ? size : 1)) == BNULL)
+    {
+        std::new_handler handler = std::get_new_handler();
+
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        handler();
+    }
+
+    return ptr;
+}
+
+void *operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+    return allocate(size, align);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align)
+{
+    return allocate(size, align);
+}
+
+void *operator new(std::size_t size, std::align_val_t align,
+                   const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return allocate(size, align);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, std::align_val_t align,
+                     const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return allocate(size, align);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+// sizes of zero were allocated as one, which is the
+// same size of block
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+    free_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+    free_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size,
+                     std::align_val_t align) noexcept
+{
+    free_aligned_sized(ptr, static_cast<std::size_t>(align), size);
+}
+
+void operator delete[](void *ptr, std::size_t size,
+                       std::align_val_t align) noexcept
+{
+    free_aligned_sized(ptr, static_cast<std::size_t>(align), size);
+}
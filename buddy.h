@@ -1,7 +1,12 @@
+#if defined(BUDDY_IMPLEMENTATION) && !defined(_GNU_SOURCE)
+// for mremap, if nothing was included before us
+#define _GNU_SOURCE
+#endif
 
 /**
- *  Buddy allocator. Do not use in conjunction with
- *  malloc / free.
+ *  Buddy allocator. Memory is mapped in superblocks aligned
+ *  to their size, each holding its own buddy tree, so it
+ *  can be used alongside malloc / free.
  *
  *  Usage:
  *
@@ -14,6 +19,88 @@
  *          *ptr = 'X';
  *          bfree(ptr);
  *      }
+ *
+ *  Options (define before including the implementation):
+ *
+ *      BUDDY_STDLIB_OVERRIDE   export malloc / free / realloc / calloc
+ *      BUDDY_SUPERBLOCK_ORDER  log2 of the size of each mmap'd superblock,
+ *                              larger allocations get their own mapping
+ *      BUDDY_OOB_METADATA      keep block state in bitmaps below each
+ *                              superblock instead of block headers, so
+ *                              blocks are exact powers of two
+ *      BUDDY_SLAB              serve requests up to BUDDY_SLAB_MAX from
+ *                              slabs of finer size classes (16, 24, 32,
+ *                              48, ...) carved out of the buddy heap
+ *      BUDDY_SLAB_MAX          largest request served from a slab, at
+ *                              most 4096
+ *      BUDDY_SLAB_ORDER        log2 of the size of each slab
+ *      BUDDY_NO_TCACHE         disable the per-thread cache of small blocks
+ *      BUDDY_TCACHE_MAX_ORDER  largest block order kept in the thread cache,
+ *                              with BUDDY_SLAB every size class is kept
+ *      BUDDY_TCACHE_BATCH      blocks moved per fill / flush of the smallest
+ *                              size, fewer for larger ones
+ *      BUDDY_NO_TRIM           never return memory to the os from bfree,
+ *                              only from btrim
+ *      BUDDY_TRIM_THRESHOLD    smallest free block released by bfree
+ *      BUDDY_TRIM_DECAY_MS     least time between two releases from bfree
+ *      BUDDY_TRIM_MADV_FREE    release pages with MADV_FREE instead of
+ *                              MADV_DONTNEED
+ *      BUDDY_STATS             keep counters for buddy_stats
+ *      BUDDY_STATS_SLOTS       the number of slots threads count
+ *                              allocations in, summed by buddy_stats
+ *      BUDDY_PROFILE           compile in the sampling heap profiler,
+ *                              see buddy_profile_dump
+ *      BUDDY_PROFILE_DEPTH     the most stack frames kept per sample
+ *      BUDDY_NUMA              keep a heap per NUMA node. threads allocate
+ *                              from the heap of their node, and memory
+ *                              freed on another node is queued for its
+ *                              own heap to take back
+ *      BUDDY_NUMA_NODES        the most heaps, nodes beyond share them
+ *      BUDDY_THREAD_HEAPS      give each thread a heap of its own. memory
+ *                              freed by another thread is pushed onto a
+ *                              queue of its heap, which the owner takes
+ *                              back at once the next time it locks it.
+ *                              can't be combined with BUDDY_NUMA
+ *      BUDDY_THREAD_HEAPS_MAX  the most heaps, threads beyond share them
+ *      BUDDY_HUGEPAGES         back superblocks and mapped blocks with
+ *                              transparent huge pages (MADV_HUGEPAGE).
+ *                              free blocks are then only purged in
+ *                              whole huge pages
+ *      BUDDY_HUGETLB           map superblocks with MAP_HUGETLB, or as
+ *                              with BUDDY_HUGEPAGES when the system has
+ *                              no huge pages left
+ *      BUDDY_HUGEPAGE_ORDER    log2 of the huge page size, 21 by default
+ *      BUDDY_DEBUG             compile in the checked mode, see below
+ *      BUDDY_DEBUG_QUARANTINE_SLOTS
+ *                              the most allocations in quarantine
+ *      BUDDY_TRACE             compile in the allocation tracer, see below
+ *      BUDDY_TRACE_RECORDS     the records of each thread buffered
+ *                              before they are written out
+ *
+ *  Checked mode: with BUDDY_DEBUG, setting BUDDY_DEBUG=1 in the
+ *  environment puts canaries in front of and after every allocation.
+ *  Frees, reallocs and busable_size abort with a message when they
+ *  find memory that was freed already, written past its end, or
+ *  never allocated. BUDDY_DEBUG_GUARD=<bytes> maps allocations of
+ *  at least that size on their own, ending at a page without
+ *  access. Once freed, only the pages of their header stay, read
+ *  only, among the BUDDY_DEBUG_QUARANTINE_SLOTS most recently freed
+ *  allocations. BUDDY_DEBUG_QUARANTINE=<bytes> holds back up to that
+ *  many bytes of freed memory, filled with junk that is checked
+ *  before the memory is reused. Without BUDDY_DEBUG in the
+ *  environment the mode costs a branch per call.
+ *
+ *  Tracing: with BUDDY_TRACE, setting BUDDY_TRACE=<prefix> in the
+ *  environment records every call of balloc, bfree, brealloc,
+ *  bcalloc, baligned_alloc and the sized frees, as a
+ *  buddy_trace_record_t, to <prefix>.<pid>.trace. Each thread
+ *  buffers its own records, which a thread of the tracer writes
+ *  out, so tracing costs a clock read and a store per call.
+ *  bench -w replay runs the trace against other allocators.
+ *
+ *  The locks are held across fork, so the child of a threaded
+ *  program can allocate right away. What other threads held in
+ *  their caches is lost to it.
  */
 
 #ifndef BUDDY_H
@@ -26,421 +113,4483 @@
     #define bfree    free
     #define brealloc realloc
     #define bcalloc  calloc
+    #define baligned_alloc aligned_alloc
+    #define busable_size   malloc_usable_size
+    #define bfree_sized    free_sized
+    #define bfree_aligned_sized free_aligned_sized
 #else
     #define BNULL ((void *) 0)
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ *  Allocate `size` bytes of memory.
+ *  Returns BNULL on failure.
+ */
+void *balloc(size_t size);
+
+/**
+ *  Free previously allocated memory.
+ */
+void bfree(void *ptr);
+
+/**
+ *  Attempt to reallocate memory to fit new size.
+ *  Returns BNULL on failure.
+ */
+void *brealloc(void *ptr, size_t size);
+
+/**
+ *  Allocate memory for `nitems` objects of size `size`,
+ *  and zero memory. Returns BNULL on failure.
+ */
+void *bcalloc(size_t nitems, size_t size);
+
+/**
+ *  Allocate `size` bytes of memory aligned to `align`, a power
+ *  of two below the superblock size. Returns BNULL on failure.
+ *  With BUDDY_STDLIB_OVERRIDE this is aligned_alloc, and
+ *  posix_memalign, memalign, valloc and pvalloc are exported too.
+ */
+void *baligned_alloc(size_t align, size_t size);
+
+/**
+ *  The number of bytes usable at `ptr`, at least as many as
+ *  were asked for. With BUDDY_STDLIB_OVERRIDE this is
+ *  malloc_usable_size.
+ */
+size_t busable_size(void *ptr);
+
+/**
+ *  Free memory of `size` bytes from balloc, bcalloc or brealloc.
+ *  Faster than bfree, since the size tells where to look for the
+ *  block. A size the block can't hold fails an assertion.
+ *  With BUDDY_STDLIB_OVERRIDE this is free_sized.
+ */
+void bfree_sized(void *ptr, size_t size);
+
+/**
+ *  Free memory from baligned_alloc(align, size). With
+ *  BUDDY_STDLIB_OVERRIDE this is free_aligned_sized.
+ */
+void bfree_aligned_sized(void *ptr, size_t align, size_t size);
+
+/**
+ *  Return the pages of free memory to the operating system.
+ *  Returns the number of bytes released.
+ */
+size_t btrim(void);
+
+/**
+ *  The kinds of blocks buddy_heap_walk visits.
+ */
+enum { BUDDY_BLOCK_FREE, BUDDY_BLOCK_USED, BUDDY_BLOCK_SLAB };
+
+/**
+ *  Call `visit` for every block of the superblocks, in address
+ *  order within each, with its memory, its usable size and its
+ *  kind. Blocks in thread caches are used, and memory from
+ *  baligned_alloc may start inside its block. Allocations with
+ *  a mapping of their own are not visited. The heap is locked
+ *  while it is walked, so `visit` must not allocate or free.
+ */
+void buddy_heap_walk(void (*visit)(void *ptr, size_t size, int kind,
+                                    void *arg),
+                     void *arg);
+
+/**
+ *  How the free memory of the superblocks is split up,
+ *  see buddy_fragmentation.
+ */
+typedef struct {
+    size_t heap;            // bytes of the superblocks mapped
+    size_t free_bytes;      // bytes of the free blocks in them
+    size_t largest_free;    // bytes of the largest free block
+    size_t order_bytes[8 * sizeof(size_t)];
+                            // bytes of the free blocks of 2^n bytes
+} buddy_fragmentation_t;
+
+/**
+ *  Fill `frag`. A small block left in a superblock keeps it
+ *  from being joined into one free block, or released, so
+ *  free memory spread over small orders with little in the
+ *  largest ones means allocations larger than largest_free
+ *  map more superblocks while most of the heap is free.
+ */
+void buddy_fragmentation(buddy_fragmentation_t *frag);
+
+/**
+ *  Empty the superblocks which are at most a quarter used, as
+ *  long as what is in them fits in the others, and release
+ *  them. `move` is called without locks held for each used
+ *  block in them, with the memory the program was given and
+ *  its usable size, as from busable_size. If the program
+ *  knows the memory, it may move it with balloc and bfree and
+ *  update its pointers to it. Meanwhile the free memory of
+ *  those superblocks is held back, so the new copies go
+ *  elsewhere. Blocks of slabs, and of other thread caches,
+ *  stay where they are. Returns the number of bytes released.
+ */
+size_t buddy_defragment(void (*move)(void *ptr, size_t size,
+                                         void *arg),
+                        void *arg);
+
+#ifdef BUDDY_STATS
+/**
+ *  Counters of the allocator, see buddy_stats.
+ */
+typedef struct {
+    size_t allocs;          // allocations made
+    size_t frees;           // allocations freed
+    size_t in_use;          // usable bytes of the allocations not freed
+    size_t heap;            // bytes of the superblocks mapped
+    size_t free_bytes;      // bytes of the free blocks in superblocks
+    size_t free_blocks;     // free blocks in superblocks
+    size_t large_bytes;     // bytes of the blocks with a mapping of their own
+    size_t large_blocks;    // blocks with a mapping of their own
+    size_t grows;           // superblocks mapped so far
+    size_t splits;          // blocks split in two so far
+    size_t joins;           // blocks joined with their buddy so far
+    size_t released;        // bytes given back to the os so far
+    size_t fills;           // thread cache fills so far
+    size_t flushes;         // thread cache flushes so far
+    size_t slabs;           // slabs in use
+} buddy_stats_t;
+
+/**
+ *  Fill `stats` with the current counters. Only defined with
+ *  BUDDY_STATS. The first three are summed from per-thread
+ *  counters, so they only add up exactly while other threads
+ *  don't allocate or free. With BUDDY_STDLIB_OVERRIDE this
+ *  also exports mallinfo2 and malloc_stats.
+ */
+void buddy_stats(buddy_stats_t *stats);
+#endif
+
+#ifdef BUDDY_PROFILE
+/**
+ *  Write the sampled allocations which are not freed yet to
+ *  `path` as a pprof heap profile. Only defined with
+ *  BUDDY_PROFILE. Returns 0 on success, -1 on failure.
+ *
+ *  The profiler is off unless BUDDY_PROFILE_RATE is set in the
+ *  environment, to the average number of bytes allocated between
+ *  two samples, such as 524288. Sampled allocations get a mapping
+ *  of their own holding their backtrace. The signal in
+ *  BUDDY_PROFILE_SIGNAL, SIGUSR2 by default or 0 for none, writes
+ *  a profile to BUDDY_PROFILE_PREFIX.<pid>.<n>.heap, where the
+ *  prefix is "buddy" by default.
+ */
+int buddy_profile_dump(const char *path);
+#endif
+
+/**
+ *  The records of a BUDDY_TRACE file, which starts with the 8
+ *  bytes of BUDDY_TRACE_MAGIC. `time` is in nanoseconds of
+ *  CLOCK_MONOTONIC, `ptr` is the memory allocated or freed,
+ *  `old_ptr` what brealloc was given, and `size` the bytes asked
+ *  for, all items of bcalloc together. `thread` counts threads
+ *  from 0 in the order they were first traced. Records are in
+ *  order within each thread, not across threads.
+ */
+typedef struct {
+    uint64_t time;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint64_t size;
+    uint32_t thread;
+    uint32_t op;
+} buddy_trace_record_t;
+
+/**
+ *  The ops of trace records. A failed allocation has a null `ptr`,
+ *  and brealloc to 0 bytes frees `old_ptr`.
+ */
+enum { BUDDY_TRACE_ALLOC, BUDDY_TRACE_FREE, BUDDY_TRACE_REALLOC };
+
+// "btrace01"
+#define BUDDY_TRACE_MAGIC 0x3130656361727462ull
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
+
+#ifdef BUDDY_IMPLEMENTATION
+#undef BUDDY_IMPLEMENTATION
+
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#if defined(BUDDY_STDLIB_OVERRIDE) && defined(BUDDY_STATS)
+#include <stdio.h>
+#include <malloc.h>
+#endif
+
+#ifdef BUDDY_NUMA
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef BUDDY_DEBUG
+#include <stdlib.h>
+#include <sys/auxv.h>
+#endif
+
+#if defined(BUDDY_NUMA) && defined(BUDDY_THREAD_HEAPS)
+#error "buddy.h: BUDDY_NUMA and BUDDY_THREAD_HEAPS can't be combined."
+#endif
+
+#if defined(BUDDY_NUMA) || defined(BUDDY_THREAD_HEAPS)
+// there are several heaps, which other threads free to
+// through a queue instead of taking their lock
+#define REMOTE_HEAPS
+#endif
+
+#ifdef BUDDY_PROFILE
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#endif
+
+#ifdef BUDDY_TRACE
+#include <stdlib.h>
+#include <fcntl.h>
+#endif
+
+typedef uint8_t byte_t;
+
+// block states. the header in front of memory that
+// baligned_alloc moved up inside its block is BLOCK_ALIGNED,
+// and the block itself BLOCK_MOVED until it is freed
+enum { BLOCK_FREE, BLOCK_USED, BLOCK_MAPPED, BLOCK_ALIGNED, BLOCK_MOVED };
+
+// what the pages of a free block, except for the first which
+// holds the links, contain. PAGES_PURGED pages are not resident
+// but may come back with old contents (MADV_FREE), PAGES_ZERO
+// pages read as zero. only meaningful above the page size
+enum { PAGES_DIRTY, PAGES_PURGED, PAGES_ZERO };
+
+#ifndef BUDDY_SUPERBLOCK_ORDER
+#define BUDDY_SUPERBLOCK_ORDER 22
+#endif
+
+#ifdef BUDDY_SLAB
+#ifndef BUDDY_SLAB_MAX
+#define BUDDY_SLAB_MAX 1024
+#endif
+
+#ifndef BUDDY_SLAB_ORDER
+#define BUDDY_SLAB_ORDER 16
+#endif
+
+// the size of a slab, slabs are buddy blocks so they are
+// aligned to their size
+#define SLABSIZE ((size_t) 1 << BUDDY_SLAB_ORDER)
+// one bit per slab sized slot of a superblock
+#define SLABWORDS ((((size_t) 1 << (BUDDY_SUPERBLOCK_ORDER -\
+                                    BUDDY_SLAB_ORDER)) + 63) / 64)
+#endif
+
+// lives right below the base of a superblock, or of a
+// block with a mapping of its own. `kind` is BLOCK_USED
+// for superblocks and BLOCK_MAPPED for mapped blocks,
+// `size` is the length of the mapping above the base of
+// mapped blocks. bit n of `slabs` is set if the n:th slab
+// sized slot of a superblock is a slab. `sampled` is set for
+// mapped blocks the profiler keeps a sample of. `heap` is the
+// index of the heap a superblock belongs to. `prev` and `next`
+// link the superblocks of a heap, and `withheld` and `evacuate`
+// are only used by buddy_defragment
+struct superblock {
+    size_t size;
+    int kind;
+    struct block *prev;
+    struct block *next;
+    struct block *withheld;
+    struct block *evacuate;
+#ifdef REMOTE_HEAPS
+    unsigned heap;
+#endif
+#ifdef BUDDY_PROFILE
+    int sampled;
+#endif
+#ifdef BUDDY_SLAB
+    uint64_t slabs[SLABWORDS];
+#endif
+};
+
+#ifdef BUDDY_OOB_METADATA
+
+// blocks have no header, a block is just its memory.
+// the state of the blocks in a superblock is kept in
+// bitmaps right below the superblock
+struct block;
+
+#else
+
+// `size` is a power of two. `purged` is one of PAGES_*
+// for free blocks, and how far the memory was moved up
+// for BLOCK_MOVED blocks
+struct block {
+    size_t size;
+    int used;
+    int purged;
+    _Alignas(max_align_t) byte_t mem[];
+};
+
+#endif
+
+// free blocks keep their free list links in
+// the usable memory region
+struct links {
+    struct block *prev;
+    struct block *next;
+};
+
+#ifdef BUDDY_OOB_METADATA
+// free blocks above the smallest order have room
+// to record their PAGES_* state
+struct purged_links {
+    struct links links;
+    int purged;
+};
+#endif
+
+#ifndef BUDDY_TCACHE_MAX_ORDER
+#define BUDDY_TCACHE_MAX_ORDER 11
+#endif
+
+#ifndef BUDDY_TRIM_THRESHOLD
+#define BUDDY_TRIM_THRESHOLD (128 * 1024)
+#endif
+
+#ifndef BUDDY_TRIM_DECAY_MS
+#define BUDDY_TRIM_DECAY_MS 1000
+#endif
+
+#if defined(BUDDY_HUGETLB) && !defined(BUDDY_HUGEPAGES)
+#define BUDDY_HUGEPAGES
+#endif
+
+#ifdef BUDDY_HUGEPAGES
+#ifndef BUDDY_HUGEPAGE_ORDER
+#define BUDDY_HUGEPAGE_ORDER 21
+#endif
+#define HUGEPAGESIZE ((size_t) 1 << BUDDY_HUGEPAGE_ORDER)
+// the memory at the start of a free block purge leaves alone,
+// so huge pages are not split to release a part of them
+#define PURGE_KEEP HUGEPAGESIZE
+#else
+#define PURGE_KEEP pagesize
+#endif
+
+#ifdef BUDDY_TRIM_MADV_FREE
+#define TRIM_ADVICE MADV_FREE
+#define TRIM_PAGES PAGES_PURGED
+#else
+#define TRIM_ADVICE MADV_DONTNEED
+#ifdef BUDDY_HUGEPAGES
+// all but the first huge page are zero, which PAGES_ZERO
+// can't tell apart from a dirty first page
+#define TRIM_PAGES PAGES_PURGED
+#else
+#define TRIM_PAGES PAGES_ZERO
+#endif
+#endif
+
+#ifndef BUDDY_TCACHE_BATCH
+#define BUDDY_TCACHE_BATCH 32
+#endif
+
+#ifdef BUDDY_OOB_METADATA
+// the offset of the usable memory region in a block
+#define MEMOFFSET ((size_t) 0)
+// the usable memory region of `block_ptr`
+#define MEM(block_ptr) ((void *) (block_ptr))
+// get pointer to block containing `mem`
+#define BLOCK(mem) ((struct block *) (mem))
+// the order of the smallest block size
+#define MINORDER 4
+#else
+// the offset of the usable memory region in a block
+#define MEMOFFSET (offsetof(struct block, mem))
+// the usable memory region of `block_ptr`
+#define MEM(block_ptr) ((void *) (block_ptr)->mem)
+// get pointer to block containing `mem`
+#define BLOCK(mem) (struct block *)((byte_t *)mem - MEMOFFSET)
+// the order of the smallest block size
+#define MINORDER 5
+#endif
+
+// the block right after `block_ptr` of order `order`
+#define NEXT(block_ptr, order)\
+    (struct block *)((byte_t *)(block_ptr) + ((size_t) 1 << (order)))
+// the buddy of `block_ptr` of order `order`
+#define BUDDY(block_ptr, order)\
+    (struct block *)((uintptr_t)(block_ptr) ^ ((uintptr_t) 1 << (order)))
+// the size of usable memory a block of order `order` can hold
+#define MEMSIZE(order) (((size_t) 1 << (order)) - MEMOFFSET)
+// free list links of a free block
+#define LINKS(block_ptr) ((struct links *) MEM(block_ptr))
+// the smallest size a block can be
+#define MINBLOCKSIZE ((size_t) 1 << MINORDER)
+// the number of free lists, one per order
+#define MAXORDER (8 * sizeof(size_t))
+// the largest usable size we can allocate
+#define MAXMEMSIZE (((size_t) 1 << (MAXORDER - 1)) - MEMOFFSET)
+// the size of a block that can hold `memsize` bytes
+// of usable memory
+#define BLOCKSIZE(memsize) (memsize + MEMOFFSET)
+// the byte offset between two pointers
+#define BYTEDIFF(ptr1, ptr2)\
+    (size_t) ((byte_t *) (ptr2) - (byte_t *) (ptr1))
+// the size of a superblock, the largest block in a buddy tree
+#define SUPERBLOCKSIZE ((size_t) 1 << BUDDY_SUPERBLOCK_ORDER)
+// the superblock containing `ptr`, superblocks are aligned to their size
+#define SUPERBLOCK(ptr)\
+    ((byte_t *) ((uintptr_t) (ptr) & ~(uintptr_t) (SUPERBLOCKSIZE - 1)))
+// round `size` up to a multiple of `align`, a power of two
+#define ALIGNUP(size, align)\
+    (((size) + (align) - 1) & ~((size_t) (align) - 1))
+
+// the descriptor of the mapping containing `ptr`
+#define DESCRIPTOR(ptr) ((struct superblock *) SUPERBLOCK(ptr) - 1)
+
+#ifdef BUDDY_OOB_METADATA
+// nodes of a buddy tree are numbered from 1 at the root,
+// the children of node n are 2n and 2n + 1
+#define TREEDEPTH (BUDDY_SUPERBLOCK_ORDER - MINORDER)
+// one bit per node that can be split, that is every
+// node above the smallest order
+#define SPLITWORDS ((((size_t) 1 << TREEDEPTH) + 63) / 64)
+// one bit per node, set if the node is a free block
+#define FREEWORDS ((((size_t) 2 << TREEDEPTH) + 63) / 64)
+// the bytes of metadata right below a superblock
+#define METABYTES\
+    ((SPLITWORDS + FREEWORDS) * sizeof(uint64_t) + sizeof(struct superblock))
+// the bitmaps of the buddy tree containing `ptr`
+#define SPLITBITS(ptr)\
+    ((uint64_t *) DESCRIPTOR(ptr) - SPLITWORDS - FREEWORDS)
+#define FREEBITS(ptr) (SPLITBITS(ptr) + SPLITWORDS)
+#else
+// the bytes of metadata right below a superblock
+#define METABYTES (sizeof(struct superblock))
+#endif
+
+_Static_assert(MINBLOCKSIZE >= MEMOFFSET + sizeof(struct links),
+               "buddy.h: MINORDER too small to hold free list links.");
+
+_Static_assert(BUDDY_SUPERBLOCK_ORDER > MINORDER &&
+               BUDDY_SUPERBLOCK_ORDER < MAXORDER,
+               "buddy.h: BUDDY_SUPERBLOCK_ORDER out of range.");
+
+#ifndef BUDDY_OOB_METADATA
+// memory is moved up by less than a superblock
+_Static_assert(BUDDY_SUPERBLOCK_ORDER < 8 * sizeof(int) - 1,
+               "buddy.h: BUDDY_SUPERBLOCK_ORDER too large.");
+#endif
+
+_Static_assert((BUDDY_TRIM_THRESHOLD & (BUDDY_TRIM_THRESHOLD - 1)) == 0,
+               "buddy.h: BUDDY_TRIM_THRESHOLD must be a power of two.");
+
+#ifdef BUDDY_HUGEPAGES
+_Static_assert(BUDDY_HUGEPAGE_ORDER <= BUDDY_SUPERBLOCK_ORDER,
+               "buddy.h: superblocks smaller than a huge page.");
+#endif
+
+// mapped blocks only have a page below them
+_Static_assert(sizeof(struct superblock) <= 4096,
+               "buddy.h: superblock descriptor larger than a page.");
+
+#ifdef BUDDY_SLAB
+// A slab is a used buddy block of order BUDDY_SLAB_ORDER cut
+// into objects of one size class, like the pool in pool.h.
+// freed objects are singly linked through their first word,
+// the rest are carved from `front` on demand. `prev` and
+// `next` link the slabs of a class that have objects left
+struct slab {
+    struct slab *prev;
+    struct slab *next;
+    void *free;
+    byte_t *front;
+    byte_t *end;
+    unsigned used;
+    unsigned size_class;
+};
+
+// sizes are multiples of 8, so objects are aligned to the
+// largest alignment a type of that size can have
+static const size_t slab_sizes[] = {
+    16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320,
+    384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+
+// the number of size classes
+#define SLAB_NCLASSES (sizeof(slab_sizes) / sizeof(slab_sizes[0]))
+// the slab holding object `ptr`
+#define SLAB(ptr) ((struct slab *) MEM((struct block *)\
+    ((uintptr_t) (ptr) & ~(uintptr_t) (SLABSIZE - 1))))
+// the size class of `size` bytes, at most BUDDY_SLAB_MAX
+#define SLAB_CLASS(size) (slab_classes[((size) + 7) / 8])
+
+_Static_assert(BUDDY_SLAB_MAX % 8 == 0 && BUDDY_SLAB_MAX <= 4096,
+               "buddy.h: BUDDY_SLAB_MAX must be a multiple of 8 up to 4096.");
+
+_Static_assert(BUDDY_SLAB_ORDER <= BUDDY_SUPERBLOCK_ORDER &&
+               ((size_t) 1 << BUDDY_SLAB_ORDER) >= 4 * BUDDY_SLAB_MAX,
+               "buddy.h: BUDDY_SLAB_ORDER out of range.");
+#endif
+
+#ifndef BUDDY_NO_TCACHE
+#ifdef BUDDY_SLAB
+// one thread cache bin per size class
+#define TCACHE_NBINS SLAB_NCLASSES
+// the bytes taken by an object of bin `index`
+#define BINBYTES(index) (slab_sizes[index])
+#else
+// one thread cache bin per order
+#define TCACHE_NBINS (BUDDY_TCACHE_MAX_ORDER - MINORDER + 1)
+// the bytes taken by an object of bin `index`
+#define BINBYTES(index) ((size_t) 1 << (MINORDER + (index)))
+#endif
+// the number of objects moved per fill / flush of bin `index`
+#define TCACHE_BATCH(index)\
+    (BUDDY_TCACHE_BATCH * BINBYTES(0) / BINBYTES(index) > 4 ?\
+     BUDDY_TCACHE_BATCH * BINBYTES(0) / BINBYTES(index) : 4)
+// the number of objects a bin may hold before it is flushed
+#define TCACHE_LIMIT(index) (2 * TCACHE_BATCH(index))
+
+_Static_assert(BUDDY_TCACHE_MAX_ORDER >= MINORDER,
+               "buddy.h: BUDDY_TCACHE_MAX_ORDER smaller than MINORDER.");
+
+enum { TCACHE_UNINIT, TCACHE_ACTIVE, TCACHE_DEAD };
+
+// cached objects are used as far as the heap knows,
+// and singly linked through their first word
+struct tcache_bin {
+    void *head;
+    unsigned count;
+};
+
+struct tcache {
+    int state;
+    struct tcache_bin bins[TCACHE_NBINS];
+};
+#endif
+
+#ifdef BUDDY_STATS
+#ifndef BUDDY_STATS_SLOTS
+#define BUDDY_STATS_SLOTS 64
+#endif
+
+// allocation counters of the threads using a slot. threads
+// take slots in turn, so until there are more threads than
+// slots each has its own, on a cache line of its own
+struct stats_slot {
+    _Alignas(64) size_t allocs;
+    size_t frees;
+    size_t allocated;
+    size_t freed;
+};
+
+// counters of `heap`, its lock must be held
+#define STAT_ADD(h, field, n) ((h)->stats.field += (n))
+// counters of mapped blocks, which are made without the lock
+#define STAT_ADD_LARGE(field, n)\
+    ((void) __atomic_fetch_add(&field, (n), __ATOMIC_RELAXED))
+#else
+#define STAT_ADD(h, field, n) ((void) (h))
+#define STAT_ADD_LARGE(field, n) ((void) 0)
+#endif
+
+#ifdef BUDDY_PROFILE
+#ifndef BUDDY_PROFILE_DEPTH
+#define BUDDY_PROFILE_DEPTH 64
+#endif
+
+// a sampled allocation of `size` bytes, kept right below
+// the descriptor of its mapping. `frames` are the return
+// addresses of the allocating stack
+struct sample {
+    struct sample *prev;
+    struct sample *next;
+    size_t size;
+    int depth;
+    void *frames[BUDDY_PROFILE_DEPTH];
+};
+
+// the sample of a mapped block
+#define SAMPLE(block) ((struct sample *) DESCRIPTOR(block) - 1)
+
+_Static_assert(sizeof(struct superblock) + sizeof(struct sample) <= 4096,
+               "buddy.h: BUDDY_PROFILE_DEPTH too large.");
+
+// per thread
+struct sampler {
+    // bytes left to allocate until the next sample
+    int64_t countdown;
+    // xorshift state, zero until the first interval is drawn
+    uint64_t rng;
+    // set while taking a sample, so that the allocations
+    // backtrace makes are not sampled
+    int busy;
+};
+#endif
+#ifdef BUDDY_DEBUG
+#ifndef BUDDY_DEBUG_QUARANTINE_SLOTS
+#define BUDDY_DEBUG_QUARANTINE_SLOTS 4096
+#endif
+#endif
+
+#ifdef BUDDY_TRACE
+#ifndef BUDDY_TRACE_RECORDS
+#define BUDDY_TRACE_RECORDS 4096
+#endif
+
+// records of one thread, handed to the writer once full
+struct trace_buffer {
+    struct trace_buffer *next;
+    size_t count;
+    buddy_trace_record_t records[BUDDY_TRACE_RECORDS];
+};
+
+// per thread
+struct tracer {
+    struct trace_buffer *buffer;
+    uint32_t thread;
+    // traced calls under way, of which only the outermost
+    // is recorded, so brealloc calling balloc is one record
+    unsigned depth;
+    // set for the writer, and threads that are exiting
+    int off;
+};
+
+// count a traced call under way
+#define TRACE_ENTER() (tracer.depth++)
+// record the outermost traced call
+#define TRACE_LEAVE(op, ptr, old_ptr, size)\
+    ((void) (--tracer.depth == 0 && trace_fd != -1 ?\
+             (trace(op, ptr, old_ptr, size), 0) : 0))
+// record a free before it is done, so that it comes before
+// another thread is given the memory
+#define TRACE_FREE(ptr, size)\
+    ((void) (tracer.depth == 0 && trace_fd != -1 && (ptr) != BNULL ?\
+             (trace(BUDDY_TRACE_FREE, ptr, BNULL, size), 0) : 0))
+#else
+#define TRACE_ENTER() ((void) 0)
+#define TRACE_LEAVE(op, ptr, old_ptr, size) ((void) 0)
+#define TRACE_FREE(ptr, size) ((void) 0)
+#endif
+
+#ifdef BUDDY_NUMA
+#ifndef BUDDY_NUMA_NODES
+#define BUDDY_NUMA_NODES 8
+#endif
+#define NHEAPS BUDDY_NUMA_NODES
+#elif defined(BUDDY_THREAD_HEAPS)
+#ifndef BUDDY_THREAD_HEAPS_MAX
+#define BUDDY_THREAD_HEAPS_MAX 64
+#endif
+#define NHEAPS BUDDY_THREAD_HEAPS_MAX
+#endif
+
+#ifdef REMOTE_HEAPS
+// the heap `ptr`, which is not a mapped block, belongs to
+#define HEAP_OF(ptr) (&heaps[DESCRIPTOR(ptr)->heap])
+#else
+#define NHEAPS 1
+#define HEAP_OF(ptr) (&heaps[0])
+#endif
+
+// the superblocks of a heap and everything in them
+// are only touched with the lock of the heap held
+struct heap {
+    _Alignas(64) pthread_mutex_t lock;
+    // every superblock of the heap
+    struct block *superblocks;
+    // one list of free blocks per order
+    struct block *free_lists[MAXORDER];
+    // bit n is set if free_lists[n] is non-empty
+    unsigned long long free_mask;
+#ifdef BUDDY_SLAB
+    // the slabs of each size class with objects left
+    struct slab *partial_slabs[SLAB_NCLASSES];
+#endif
+#ifndef BUDDY_NO_TRIM
+    // set when a block of at least BUDDY_TRIM_THRESHOLD
+    // bytes was freed since the last trim
+    int trim_pending;
+    // the time of the last trim in milliseconds
+    uint64_t last_trim;
+#endif
+#ifdef BUDDY_STATS
+    buddy_stats_t stats;
+#endif
+#ifdef BUDDY_THREAD_HEAPS
+    // set while a thread owns the heap
+    int owned;
+#endif
+#ifdef REMOTE_HEAPS
+    // memory other threads freed, linked through its first
+    // word, on a cache line of its own since they all push to it
+    _Alignas(64) void *remote;
+#endif
+};
+
+
+static struct heap heaps[NHEAPS];
+// lock for initialization
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+// library initialization flag, set with release order once
+// everything init sets up can be used, read with is_init
+static int Buddy_Is_Init = 0;
+// the system page size
+static size_t pagesize;
+// the bytes mapped right below each superblock for metadata
+static size_t meta_size;
+
+#ifdef BUDDY_SLAB
+// the size class of each size up to BUDDY_SLAB_MAX, in steps of 8
+static uint8_t slab_classes[BUDDY_SLAB_MAX / 8 + 1];
+#endif
+
+#ifdef REMOTE_HEAPS
+// the heap of the node the thread last ran on, or
+// with BUDDY_THREAD_HEAPS the one it owns
+static _Thread_local struct heap *thread_heap
+    __attribute__((tls_model("initial-exec")));
+#endif
+
+#ifdef BUDDY_THREAD_HEAPS
+// used to give up the heaps of exiting threads
+static pthread_key_t heap_key;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+// the heap the next thread finding all of them owned shares
+static unsigned heap_next_shared;
+#endif
+
+#ifndef BUDDY_NO_TCACHE
+// initial-exec, so that accessing the cache never calls
+// into the dynamic linker (which may call malloc)
+static _Thread_local struct tcache tcache
+    __attribute__((tls_model("initial-exec")));
+// used to drain the cache of exiting threads
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#endif
+
+#ifdef BUDDY_STATS
+static size_t large_bytes;
+static size_t large_blocks;
+static struct stats_slot stats_slots[BUDDY_STATS_SLOTS];
+// the slot the next thread takes
+static unsigned stats_next_slot;
+static _Thread_local struct stats_slot *thread_slot
+    __attribute__((tls_model("initial-exec")));
+#endif
+
+#ifdef BUDDY_PROFILE
+// average bytes between two samples, 0 while the profiler is off
+static size_t profile_rate;
+// the allocations sampled and not freed yet
+static struct sample *samples;
+// set while `samples` is used. a spin lock instead of a mutex,
+// since the signal handler may only try it
+static int profile_busy;
+// set when a signal asked for a profile, which is written
+// by whoever next finds `samples` not busy
+static int profile_pending;
+// the profile files written for signals so far
+static unsigned profile_dumps;
+static char profile_prefix[256] = "buddy";
+static _Thread_local struct sampler sampler
+    __attribute__((tls_model("initial-exec")));
+#endif
+
+#ifdef BUDDY_DEBUG
+// set when the environment asked for the checked mode
+static int debug_mode;
+// mixed into the canaries, so they can't be guessed
+static uint64_t debug_secret;
+// the smallest allocation given a guard page, 0 for none
+static size_t debug_guard;
+// the most bytes of freed memory held back from reuse
+static size_t debug_quarantine;
+// the freed memory held back, oldest first, in a ring
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *quarantine[BUDDY_DEBUG_QUARANTINE_SLOTS];
+static size_t quarantine_first;
+static size_t quarantine_count;
+static size_t quarantine_bytes;
+#endif
+
+#ifdef BUDDY_TRACE
+// the trace file, -1 while not tracing
+static int trace_fd = -1;
+// guards everything below but the tracer
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+// signals buffers queued, and written
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+// full buffers to write, oldest first
+static struct trace_buffer *trace_queue;
+static struct trace_buffer **trace_queue_end = &trace_queue;
+// buffers written out, to be filled again
+static struct trace_buffer *trace_spare;
+// set while the writer writes a buffer
+static int trace_writing;
+// set once the writer was started
+static int trace_started;
+// the number the next thread traced gets
+static uint32_t trace_threads;
+// used to hand in the buffers of exiting threads
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct tracer tracer
+    __attribute__((tls_model("initial-exec")));
+#endif
+
+#ifdef BUDDY_STDLIB_OVERRIDE
+// we call bfree (=free when this ^^^ is defined)
+// and then use the pointer in some functions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuse-after-free"
+#endif
+
+// the order of the smallest block that can hold
+// `memsize` bytes of usable memory
+static unsigned order_of(size_t memsize)
+{
+    size_t size = BLOCKSIZE(memsize);
+
+    if (size <= MINBLOCKSIZE)
+    {
+        return MINORDER;
+    }
+
+    return MAXORDER - __builtin_clzll(size - 1);
+}
+
+#ifdef BUDDY_STATS
+static struct stats_slot *get_stats_slot(void)
+{
+    unsigned n;
+
+    if (thread_slot == BNULL)
+    {
+        n = __atomic_fetch_add(&stats_next_slot, 1, __ATOMIC_RELAXED);
+        thread_slot = &stats_slots[n % BUDDY_STATS_SLOTS];
+    }
+
+    return thread_slot;
+}
+#endif
+
+// count an allocation of `size` usable bytes at `ptr`,
+// unless it failed. returns `ptr`
+static void *count_alloc(void *ptr, size_t size)
+{
+#ifdef BUDDY_STATS
+    struct stats_slot *slot;
+
+    if (ptr != BNULL)
+    {
+        slot = get_stats_slot();
+        (void) __atomic_fetch_add(&slot->allocs, 1, __ATOMIC_RELAXED);
+        (void) __atomic_fetch_add(&slot->allocated, size, __ATOMIC_RELAXED);
+    }
+#else
+    (void) size;
+#endif
+    return ptr;
+}
+
+static void count_free(size_t size)
+{
+#ifdef BUDDY_STATS
+    struct stats_slot *slot = get_stats_slot();
+
+    (void) __atomic_fetch_add(&slot->frees, 1, __ATOMIC_RELAXED);
+    (void) __atomic_fetch_add(&slot->freed, size, __ATOMIC_RELAXED);
+#else
+    (void) size;
+#endif
+}
+
+// an allocation of `old_size` usable bytes now has `size`
+static void count_resize(size_t old_size, size_t size)
+{
+#ifdef BUDDY_STATS
+    struct stats_slot *slot = get_stats_slot();
+
+    (void) __atomic_fetch_add(&slot->allocated, size, __ATOMIC_RELAXED);
+    (void) __atomic_fetch_add(&slot->freed, old_size, __ATOMIC_RELAXED);
+#else
+    (void) old_size;
+    (void) size;
+#endif
+}
+
+#ifdef BUDDY_OOB_METADATA
+
+static int test_bit(const uint64_t *bits, size_t n)
+{
+    return (bits[n / 64] >> (n % 64)) & 1;
+}
+
+static void set_bit(uint64_t *bits, size_t n)
+{
+    bits[n / 64] |= (uint64_t) 1 << (n % 64);
+}
+
+static void clear_bit(uint64_t *bits, size_t n)
+{
+    bits[n / 64] &= ~((uint64_t) 1 << (n % 64));
+}
+
+// the node of the block of order `order` at `block`
+static size_t node_of(struct block *block, unsigned order)
+{
+    return ((size_t) 1 << (BUDDY_SUPERBLOCK_ORDER - order)) +
+           (BYTEDIFF(SUPERBLOCK(block), block) >> order);
+}
+
+#endif
+
+// The functions below are the only ones that know where
+// the state of a block is kept.
+
+// the order of the block at `block`. a used block is only
+// ever looked up by its owner, and the bits read here don't
+// change while it is used, so this needs no lock
+static unsigned block_order(struct block *block)
+{
+#ifdef BUDDY_OOB_METADATA
+    // walk up from the smallest node starting at `block`,
+    // the block is the first node whose parent is split
+    const uint64_t *split = SPLITBITS(block);
+    size_t node = node_of(block, MINORDER);
+    unsigned order = MINORDER;
+
+    while (node > 1 && !test_bit(split, node / 2))
+    {
+        node /= 2;
+        order++;
+    }
+
+    return order;
+#else
+    return (unsigned) __builtin_ctzll(block->size);
+#endif
+}
+
+// whether the used block at `block` is of order `order`,
+// which is cheaper to check than block_order is to find
+static int has_order(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    const uint64_t *split = SPLITBITS(block);
+    size_t node;
+
+    if (order > BUDDY_SUPERBLOCK_ORDER ||
+        ((uintptr_t) block & (((uintptr_t) 1 << order) - 1)) != 0)
+    {
+        return 0;
+    }
+
+    // the node is not split, but its parent is
+    node = node_of(block, order);
+    return (order == MINORDER || !test_bit(split, node)) &&
+           (node == 1 || test_bit(split, node / 2));
+#else
+    return order <= BUDDY_SUPERBLOCK_ORDER &&
+           block->size == (size_t) 1 << order;
+#endif
+}
+
+static void mark_free(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    set_bit(FREEBITS(block), node_of(block, order));
+#else
+    block->size = (size_t) 1 << order;
+    block->used = BLOCK_FREE;
+#endif
+}
+
+static void mark_used(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    clear_bit(FREEBITS(block), node_of(block, order));
+#else
+    block->size = (size_t) 1 << order;
+    block->used = BLOCK_USED;
+#endif
+}
+
+// whether there is a free block of order `order` at `block`
+static int is_free(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    return test_bit(FREEBITS(block), node_of(block, order));
+#else
+    return block->size == (size_t) 1 << order && block->used == BLOCK_FREE;
+#endif
+}
+
+// whether the node of order `order` at `block` is split,
+// where `block` is a block or a split node
+static int is_split(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    return order > MINORDER &&
+           test_bit(SPLITBITS(block), node_of(block, order));
+#else
+    // the header holds the size of the first block in the node
+    return block->size < (size_t) 1 << order;
+#endif
+}
+
+// `block` of order `order` is now two blocks of order `order - 1`
+static void mark_split(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    set_bit(SPLITBITS(block), node_of(block, order));
+#else
+    block->size = (size_t) 1 << (order - 1);
+#endif
+}
+
+// the two halves of `block` are now one block of order `order`
+static void mark_joined(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    clear_bit(SPLITBITS(block), node_of(block, order));
+#else
+    block->size = (size_t) 1 << order;
+#endif
+}
+
+// only meaningful for free blocks
+static int get_purged(struct block *block, unsigned order)
+{
+#ifdef BUDDY_OOB_METADATA
+    return order > MINORDER ? ((struct purged_links *) block)->purged : 0;
+#else
+    (void) order;
+    return block->purged;
+#endif
+}
+
+static void set_purged(struct block *block, unsigned order, int purged)
+{
+#ifdef BUDDY_OOB_METADATA
+    if (order > MINORDER)
+    {
+        ((struct purged_links *) block)->purged = purged;
+    }
+#else
+    (void) order;
+    block->purged = purged;
+#endif
+}
+
+// whether `block` has a mapping of its own
+static int is_mapped(struct block *block)
+{
+    return DESCRIPTOR(block)->kind == BLOCK_MAPPED;
+}
+
+// the usable size of a block with a mapping of its own
+static size_t mapped_size(struct block *block)
+{
+    return DESCRIPTOR(block)->size - MEMOFFSET;
+}
+
+// blocks are marked free exactly while they are in a free list
+static void push_free(struct block *block, unsigned order)
+{
+    struct heap *heap = HEAP_OF(block);
+    struct links *links = LINKS(block);
+
+    mark_free(block, order);
+
+    links->prev = BNULL;
+    links->next = heap->free_lists[order];
+
+    if (links->next != BNULL)
+    {
+        LINKS(links->next)->prev = block;
+    }
+
+    heap->free_lists[order] = block;
+    heap->free_mask |= 1ull << order;
+
+    STAT_ADD(heap, free_blocks, 1);
+    STAT_ADD(heap, free_bytes, (size_t) 1 << order);
+}
+
+static void unlink_free(struct block *block, unsigned order)
+{
+    struct heap *heap = HEAP_OF(block);
+    struct links *links = LINKS(block);
+
+    if (links->prev != BNULL)
+    {
+        LINKS(links->prev)->next = links->next;
+    }
+    else
+    {
+        heap->free_lists[order] = links->next;
+    }
+
+    if (links->next != BNULL)
+    {
+        LINKS(links->next)->prev = links->prev;
+    }
+
+    if (heap->free_lists[order] == BNULL)
+    {
+        heap->free_mask &= ~(1ull << order);
+    }
+
+    STAT_ADD(heap, free_blocks, -1);
+    STAT_ADD(heap, free_bytes, -((size_t) 1 << order));
+    mark_used(block, order);
+}
+
+// pop a free block of at least order `*order` from `heap`, and
+// set `*order` to its order. returns BNULL if there is none
+static struct block *pop_free(struct heap *heap, unsigned *order)
+{
+    unsigned long long mask = heap->free_mask & (~0ull << *order);
+
+    if (mask == 0)
+    {
+        return BNULL;
+    }
+
+    *order = __builtin_ctzll(mask);
+    struct block *block = heap->free_lists[*order];
+    unlink_free(block, *order);
+    return block;
+}
+
+#if defined(BUDDY_PROFILE) || defined(BUDDY_DEBUG) || defined(BUDDY_TRACE)
+// write the digits of `n` in `base` to `dst`, returns how many
+static size_t format_num(char *dst, uint64_t n, unsigned base)
+{
+    char digits[20];
+    size_t len = 0;
+
+    do
+    {
+        digits[len++] = "0123456789abcdef"[n % base];
+        n /= base;
+    }
+    while (n > 0);
+
+    for (size_t i = 0; i < len; i++)
+    {
+        dst[i] = digits[len - 1 - i];
+    }
+
+    return len;
+}
+
+#endif
+
+#ifdef BUDDY_PROFILE
+// a buffer for writing profiles, since the signal
+// handler can't allocate or use stdio
+struct profile_out {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[1024];
+};
+
+static void out_flush(struct profile_out *out)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out->len)
+    {
+        n = write(out->fd, out->buf + done, out->len - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            out->failed = 1;
+            break;
+        }
+        done += (size_t) n;
+    }
+
+    out->len = 0;
+}
+
+static void out_str(struct profile_out *out, const char *str)
+{
+    for (; *str != '\0'; str++)
+    {
+        if (out->len == sizeof(out->buf))
+        {
+            out_flush(out);
+        }
+        out->buf[out->len++] = *str;
+    }
+}
+
+static void out_num(struct profile_out *out, uint64_t n, unsigned base)
+{
+    char str[21];
+
+    str[format_num(str, n, base)] = '\0';
+    out_str(out, str);
+}
+
+// write the samples to `fd` in the legacy heap profile format
+// of gperftools, which pprof reads. the counts are of samples,
+// pprof scales them up by the rate. `samples` must be held.
+// returns -1 if writing failed
+static int write_profile(int fd)
+{
+    struct profile_out out;
+    size_t count = 0, bytes = 0;
+    struct sample *sample;
+    ssize_t n;
+    int maps;
+
+    out.fd = fd;
+    out.failed = 0;
+    out.len = 0;
+
+    for (sample = samples; sample != BNULL; sample = sample->next)
+    {
+        count++;
+        bytes += sample->size;
+    }
+
+    out_str(&out, "heap profile: ");
+    out_num(&out, count, 10);
+    out_str(&out, ": ");
+    out_num(&out, bytes, 10);
+    out_str(&out, " [ ");
+    out_num(&out, count, 10);
+    out_str(&out, ": ");
+    out_num(&out, bytes, 10);
+    out_str(&out, "] @ heap_v2/");
+    out_num(&out, profile_rate, 10);
+    out_str(&out, "\n");
+
+    for (sample = samples; sample != BNULL; sample = sample->next)
+    {
+        out_str(&out, "1: ");
+        out_num(&out, sample->size, 10);
+        out_str(&out, " [1: ");
+        out_num(&out, sample->size, 10);
+        out_str(&out, "] @");
+        // the first frame is map_sample
+        for (int i = 1; i < sample->depth; i++)
+        {
+            out_str(&out, " 0x");
+            out_num(&out, (uintptr_t) sample->frames[i], 16);
+        }
+        out_str(&out, "\n");
+    }
+
+    // pprof symbolizes the addresses with the mappings
+    out_str(&out, "\nMAPPED_LIBRARIES:\n");
+    out_flush(&out);
+
+    maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps == -1)
+    {
+        return -1;
+    }
+
+    while ((n = read(maps, out.buf, sizeof(out.buf))) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            out.failed = 1;
+            break;
+        }
+        out.len = (size_t) n;
+        out_flush(&out);
+    }
+
+    close(maps);
+    return -out.failed;
+}
+
+// write a profile to the next file for signals, `samples` must be held
+static void write_signal_profile(void)
+{
+    char path[sizeof(profile_prefix) + 64];
+    size_t len = strlen(profile_prefix);
+    int fd;
+
+    memcpy(path, profile_prefix, len);
+    path[len++] = '.';
+    len += format_num(path + len, (uint64_t) getpid(), 10);
+    path[len++] = '.';
+    len += format_num(path + len, profile_dumps++, 10);
+    memcpy(path + len, ".heap", sizeof(".heap"));
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1)
+    {
+        (void) write_profile(fd);
+        close(fd);
+    }
+}
+
+// write the profiles that signals asked for while `samples`
+// was busy, unless it still is. whoever holds it then sees
+// profile_pending when it lets go
+static void write_pending(void)
+{
+    while (__atomic_load_n(&profile_pending, __ATOMIC_SEQ_CST) &&
+           !__atomic_exchange_n(&profile_busy, 1, __ATOMIC_SEQ_CST))
+    {
+        if (__atomic_exchange_n(&profile_pending, 0, __ATOMIC_SEQ_CST))
+        {
+            write_signal_profile();
+        }
+        __atomic_store_n(&profile_busy, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void profile_lock(void)
+{
+    while (__atomic_exchange_n(&profile_busy, 1, __ATOMIC_SEQ_CST))
+    {
+        sched_yield();
+    }
+}
+
+static void profile_unlock(void)
+{
+    __atomic_store_n(&profile_busy, 0, __ATOMIC_SEQ_CST);
+    write_pending();
+}
+
+static void profile_handler(int signo)
+{
+    int saved_errno = errno;
+
+    (void) signo;
+    __atomic_store_n(&profile_pending, 1, __ATOMIC_SEQ_CST);
+    write_pending();
+    errno = saved_errno;
+}
+
+// read the settings of the profiler from the environment,
+// init_lock must be held
+static void profile_init(void)
+{
+    const char *rate = getenv("BUDDY_PROFILE_RATE");
+    const char *number = getenv("BUDDY_PROFILE_SIGNAL");
+    const char *prefix = getenv("BUDDY_PROFILE_PREFIX");
+    struct sigaction action;
+    int signum = SIGUSR2;
+
+    if (rate == BNULL || (profile_rate = strtoull(rate, BNULL, 10)) == 0)
+    {
+        return;
+    }
+
+    // so that sample intervals fit in 64 bits
+    if (profile_rate > ((size_t) 1 << 40))
+    {
+        profile_rate = (size_t) 1 << 40;
+    }
+
+    if (prefix != BNULL && strlen(prefix) < sizeof(profile_prefix))
+    {
+        strcpy(profile_prefix, prefix);
+    }
+
+    if (number != BNULL)
+    {
+        signum = atoi(number);
+    }
+
+    if (signum > 0)
+    {
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = profile_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        (void) sigaction(signum, &action, BNULL);
+    }
+}
+#endif
+
+#ifdef BUDDY_DEBUG
+// read the settings of the checked mode from the
+// environment, init_lock must be held
+static void debug_init(void)
+{
+    const char *mode = getenv("BUDDY_DEBUG");
+    const char *guard = getenv("BUDDY_DEBUG_GUARD");
+    const char *quarantine_size = getenv("BUDDY_DEBUG_QUARANTINE");
+    const uint64_t *random = (const uint64_t *) getauxval(AT_RANDOM);
+
+    if (mode == BNULL || atoi(mode) == 0)
+    {
+        return;
+    }
+
+    if (random != BNULL)
+    {
+        memcpy(&debug_secret, random, sizeof(debug_secret));
+    }
+    debug_secret ^= (uintptr_t) &debug_secret;
+
+    if (guard != BNULL)
+    {
+        debug_guard = strtoull(guard, BNULL, 10);
+    }
+
+    if (quarantine_size != BNULL)
+    {
+        debug_quarantine = strtoull(quarantine_size, BNULL, 10);
+    }
+
+    debug_mode = 1;
+}
+#endif
+
+#ifdef BUDDY_TRACE
+// write all `size` bytes at `data` to the trace,
+// giving up on errors
+static void trace_write(const void *data, size_t size)
+{
+    const byte_t *bytes = data;
+    ssize_t written;
+
+    while (size > 0)
+    {
+        written = write(trace_fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return;
+        }
+        bytes += written;
+        size -= (size_t) written;
+    }
+}
+
+// take the queue, trace_lock must be held
+static struct trace_buffer *trace_take(void)
+{
+    struct trace_buffer *buffer = trace_queue;
+
+    trace_queue = BNULL;
+    trace_queue_end = &trace_queue;
+    return buffer;
+}
+
+// give written buffers back, trace_lock must be held
+static void trace_recycle(struct trace_buffer *buffer)
+{
+    struct trace_buffer *next;
+
+    for (; buffer != BNULL; buffer = next)
+    {
+        next = buffer->next;
+        buffer->next = trace_spare;
+        trace_spare = buffer;
+    }
+}
+
+// writes out the buffers threads queue, in the order they were queued
+static void *trace_writer(void *arg)
+{
+    struct trace_buffer *buffers, *buffer;
+
+    (void) arg;
+    tracer.off = 1;
+
+    pthread_mutex_lock(&trace_lock);
+    for (;;)
+    {
+        while (trace_queue == BNULL)
+        {
+            pthread_cond_wait(&trace_cond, &trace_lock);
+        }
+
+        buffers = trace_take();
+        trace_writing = 1;
+        pthread_mutex_unlock(&trace_lock);
+
+        for (buffer = buffers; buffer != BNULL; buffer = buffer->next)
+        {
+            trace_write(buffer->records,
+                        buffer->count * sizeof(buffer->records[0]));
+        }
+
+        pthread_mutex_lock(&trace_lock);
+        trace_recycle(buffers);
+        trace_writing = 0;
+        pthread_cond_broadcast(&trace_cond);
+    }
+
+    return BNULL;
+}
+
+// queue the buffer of the calling thread, which
+// takes another on its next record
+static void trace_submit(void)
+{
+    struct trace_buffer *buffer = tracer.buffer;
+    pthread_t thread;
+    int start;
+
+    tracer.buffer = BNULL;
+    if (buffer == BNULL || buffer->count == 0)
+    {
+        if (buffer != BNULL)
+        {
+            pthread_mutex_lock(&trace_lock);
+            trace_recycle(buffer);
+            pthread_mutex_unlock(&trace_lock);
+        }
+        return;
+    }
+
+    buffer->next = BNULL;
+    pthread_mutex_lock(&trace_lock);
+    *trace_queue_end = buffer;
+    trace_queue_end = &buffer->next;
+    start = !trace_started;
+    trace_started = 1;
+    pthread_cond_broadcast(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+
+    if (start)
+    {
+        // the allocations of pthread_create are not recorded
+        tracer.depth++;
+        if (pthread_create(&thread, BNULL, trace_writer, BNULL) == 0)
+        {
+            (void) pthread_detach(thread);
+        }
+        else
+        {
+            pthread_mutex_lock(&trace_lock);
+            trace_started = 0;
+            pthread_mutex_unlock(&trace_lock);
+        }
+        tracer.depth--;
+    }
+}
+
+// hand in the buffer of an exiting thread. the thread may
+// still call balloc / bfree from other destructors, which
+// are not recorded
+static void trace_detach(void *arg)
+{
+    (void) arg;
+    trace_submit();
+    tracer.off = 1;
+}
+
+static void trace_create_key(void)
+{
+    (void) pthread_key_create(&trace_key, trace_detach);
+}
+
+// record an `op` that returned `ptr`, or freed it
+static void trace(uint32_t op, void *ptr, void *old_ptr, size_t size)
+{
+    buddy_trace_record_t *record;
+    struct trace_buffer *buffer = tracer.buffer;
+    struct timespec ts;
+
+    if (tracer.off)
+    {
+        return;
+    }
+
+    if (buffer == BNULL)
+    {
+        if (tracer.thread == 0)
+        {
+            // which may allocate, and must not be recorded
+            tracer.depth++;
+            pthread_once(&trace_once, trace_create_key);
+            (void) pthread_setspecific(trace_key, &tracer);
+            tracer.depth--;
+            tracer.thread = __atomic_add_fetch(&trace_threads, 1,
+                                               __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&trace_lock);
+        buffer = trace_spare;
+        if (buffer != BNULL)
+        {
+            trace_spare = buffer->next;
+        }
+        pthread_mutex_unlock(&trace_lock);
+
+        if (buffer == BNULL)
+        {
+            buffer = mmap(BNULL, sizeof(*buffer), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED)
+            {
+                return;
+            }
+        }
+
+        buffer->count = 0;
+        tracer.buffer = buffer;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record = &buffer->records[buffer->count];
+    record->time = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+    record->ptr = (uintptr_t) ptr;
+    record->old_ptr = (uintptr_t) old_ptr;
+    record->size = size;
+    // numbered from 1 above, so that 0 means not yet
+    record->thread = tracer.thread - 1;
+    record->op = op;
+
+    if (++buffer->count == BUDDY_TRACE_RECORDS)
+    {
+        trace_submit();
+    }
+}
+
+// write out what is left when the program exits. threads still
+// running keep what they recorded since their last full buffer
+__attribute__((destructor))
+static void trace_exit(void)
+{
+    struct trace_buffer *buffers, *buffer;
+
+    if (trace_fd == -1)
+    {
+        return;
+    }
+
+    tracer.off = 1;
+
+    pthread_mutex_lock(&trace_lock);
+    while (trace_writing)
+    {
+        pthread_cond_wait(&trace_cond, &trace_lock);
+    }
+    // write ours last, without starting the writer for it
+    if (tracer.buffer != BNULL)
+    {
+        tracer.buffer->next = BNULL;
+        *trace_queue_end = tracer.buffer;
+        tracer.buffer = BNULL;
+    }
+    buffers = trace_take();
+    pthread_mutex_unlock(&trace_lock);
+
+    for (buffer = buffers; buffer != BNULL; buffer = buffer->next)
+    {
+        trace_write(buffer->records,
+                    buffer->count * sizeof(buffer->records[0]));
+    }
+}
+
+static void trace_init(void)
+{
+    const char *prefix = getenv("BUDDY_TRACE");
+    char path[4096];
+    size_t len;
+    uint64_t magic = BUDDY_TRACE_MAGIC;
+
+    if (prefix == BNULL || (len = strlen(prefix)) > sizeof(path) - 64)
+    {
+        return;
+    }
+
+    memcpy(path, prefix, len);
+    path[len++] = '.';
+    len += format_num(path + len, (uint64_t) getpid(), 10);
+    memcpy(path + len, ".trace", sizeof(".trace"));
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd != -1)
+    {
+        trace_write(&magic, sizeof(magic));
+    }
+}
+#endif
+
+// whether init has run, and what it did is visible
+// to the calling thread
+static int is_init(void)
+{
+    return __atomic_load_n(&Buddy_Is_Init, __ATOMIC_ACQUIRE);
+}
+
+// fork with every lock held, so that the child doesn't
+// inherit one another thread held halfway through an update.
+// taken in the order the rest of the code nests them
+static void fork_prepare(void)
+{
+    // the handlers were registered by whichever thread ran
+    // init, which may not be this one
+    (void) is_init();
+#ifdef BUDDY_TRACE
+    pthread_mutex_lock(&trace_lock);
+#endif
+#ifdef BUDDY_DEBUG
+    pthread_mutex_lock(&quarantine_lock);
+#endif
+#ifdef BUDDY_PROFILE
+    profile_lock();
+#endif
+    for (unsigned i = 0; i < NHEAPS; i++)
+    {
+        pthread_mutex_lock(&heaps[i].lock);
+    }
+}
+
+static void fork_parent(void)
+{
+    for (unsigned i = NHEAPS; i-- > 0;)
+    {
+        pthread_mutex_unlock(&heaps[i].lock);
+    }
+#ifdef BUDDY_PROFILE
+    profile_unlock();
+#endif
+#ifdef BUDDY_DEBUG
+    pthread_mutex_unlock(&quarantine_lock);
+#endif
+#ifdef BUDDY_TRACE
+    pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+// the child is left with the thread that forked, which
+// holds the locks. what the other threads had in their
+// caches is lost to the child
+static void fork_child(void)
+{
+#ifdef BUDDY_THREAD_HEAPS
+    // their heaps are up for grabs again
+    for (unsigned i = 0; i < NHEAPS; i++)
+    {
+        if (&heaps[i] != thread_heap)
+        {
+            heaps[i].owned = 0;
+        }
+    }
+#endif
+    for (unsigned i = NHEAPS; i-- > 0;)
+    {
+        pthread_mutex_unlock(&heaps[i].lock);
+    }
+#ifdef BUDDY_PROFILE
+    // a profile asked for by a signal is written by the parent
+    __atomic_store_n(&profile_pending, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&profile_busy, 0, __ATOMIC_SEQ_CST);
+#endif
+#ifdef BUDDY_DEBUG
+    pthread_mutex_unlock(&quarantine_lock);
+#endif
+#ifdef BUDDY_TRACE
+    // the parent writes what was recorded before the fork,
+    // and the child records to a file of its own
+    trace_recycle(trace_take());
+    trace_writing = 0;
+    trace_started = 0;
+    if (tracer.buffer != BNULL)
+    {
+        tracer.buffer->count = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (trace_fd != -1)
+    {
+        (void) close(trace_fd);
+        trace_fd = -1;
+        trace_init();
+    }
+#endif
+}
+
+// called on first use instead of from a constructor, since
+// c++ global constructors, and the dynamic linker, may call
+// malloc before any constructor of ours has run
+static void init(void)
+{
+    pthread_mutex_lock(&init_lock);
+
+    if (Buddy_Is_Init)
+    {
+        pthread_mutex_unlock(&init_lock);
+        return;
+    }
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    meta_size = ALIGNUP(METABYTES, pagesize);
+
+    for (unsigned i = 0; i < NHEAPS; i++)
+    {
+        pthread_mutex_init(&heaps[i].lock, BNULL);
+    }
+
+#ifdef BUDDY_SLAB
+    for (unsigned size = 0, size_class = 0; size <= BUDDY_SLAB_MAX; size += 8)
+    {
+        while (slab_sizes[size_class] < size)
+        {
+            size_class++;
+        }
+        slab_classes[size / 8] = size_class;
+    }
+#endif
+#ifdef BUDDY_PROFILE
+    profile_init();
+#endif
+#ifdef BUDDY_DEBUG
+    debug_init();
+#endif
+#ifdef BUDDY_TRACE
+    trace_init();
+#endif
+    __atomic_store_n(&Buddy_Is_Init, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&init_lock);
+
+    // after the heaps can be used and without init_lock held,
+    // since libc allocates to keep track of the handlers
+    (void) pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// map `size` bytes aligned to `align`, with `before` bytes
+// mapped right below. returns BNULL on failure
+static void *map_aligned(size_t size, size_t align, size_t before)
+{
+    size_t length = before + size + align;
+    byte_t *mem = mmap(BNULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    byte_t *aligned;
+
+    if (mem == MAP_FAILED)
+    {
+        return BNULL;
+    }
+
+    // trim the parts outside the aligned range
+    aligned = (byte_t *) ALIGNUP((uintptr_t) mem + before, align);
+    if (aligned - before > mem)
+    {
+        (void) munmap(mem, BYTEDIFF(mem, aligned - before));
+    }
+    (void) munmap(aligned + size, BYTEDIFF(aligned + size, mem + length));
+
+    return aligned;
+}
+
+#ifdef BUDDY_THREAD_HEAPS
+// give up the heap of an exiting thread to the next thread
+// claiming one. the thread may still call balloc / bfree
+// from other destructors, which the new owner doesn't mind
+// since both take the lock of the heap
+static void release_heap(void *arg)
+{
+    struct heap *heap = arg;
+
+    __atomic_store_n(&heap->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void create_heap_key(void)
+{
+    (void) pthread_key_create(&heap_key, release_heap);
+}
+
+// give the calling thread a heap of its own, with what
+// the thread that had it before left, or share one with
+// other threads when all of them are owned
+static struct heap *claim_heap(void)
+{
+    int owned;
+
+    pthread_once(&heap_once, create_heap_key);
+
+    for (unsigned i = 0; i < NHEAPS; i++)
+    {
+        owned = 0;
+        if (__atomic_compare_exchange_n(&heaps[i].owned, &owned, 1, 0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+        {
+            thread_heap = &heaps[i];
+            (void) pthread_setspecific(heap_key, thread_heap);
+            return thread_heap;
+        }
+    }
+
+    thread_heap = &heaps[__atomic_fetch_add(&heap_next_shared, 1,
+                                            __ATOMIC_RELAXED) % NHEAPS];
+    return thread_heap;
+}
+#endif
+
+// the heap of the node the calling thread runs on, or
+// with BUDDY_THREAD_HEAPS the one it owns
+static struct heap *local_heap(void)
+{
+#ifdef BUDDY_NUMA
+    unsigned cpu, node;
+
+    if (getcpu(&cpu, &node) != 0)
+    {
+        node = 0;
+    }
+
+    thread_heap = &heaps[node % NHEAPS];
+    return thread_heap;
+#elif defined(BUDDY_THREAD_HEAPS)
+    return thread_heap != BNULL ? thread_heap : claim_heap();
+#else
+    return &heaps[0];
+#endif
+}
+
+#ifdef BUDDY_NUMA
+// prefer the node the calling thread runs on for the pages
+// of `size` bytes at `mem`, whoever touches them first
+static void bind_local(void *mem, size_t size)
+{
+    unsigned cpu, node;
+    unsigned long mask;
+
+    if (getcpu(&cpu, &node) != 0 || node >= 8 * sizeof(mask))
+    {
+        return;
+    }
+
+    // MPOL_PREFERRED, numaif.h is not part of libc. the
+    // kernel reads one bit less of the mask than `maxnode`
+    mask = 1ul << node;
+    (void) syscall(SYS_mbind, mem, size, 1, &mask, 8 * sizeof(mask) + 1, 0);
+}
+#endif
+
+// map a superblock with its metadata below, on huge pages
+// with BUDDY_HUGEPAGES. returns BNULL on failure
+static void *map_superblock(void)
+{
+    byte_t *mem = map_aligned(SUPERBLOCKSIZE, SUPERBLOCKSIZE, meta_size);
+
+#ifdef BUDDY_HUGETLB
+    // replace the part above the metadata, which stays on
+    // normal pages, with huge pages
+    if (mem != BNULL &&
+        mmap(mem, SUPERBLOCKSIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB |
+             (BUDDY_HUGEPAGE_ORDER << MAP_HUGE_SHIFT),
+             -1, 0) != MAP_FAILED)
+    {
+        return mem;
+    }
+
+    // out of huge pages. a failed MAP_FIXED may have
+    // unmapped the range, so start over
+    if (mem != BNULL)
+    {
+        (void) munmap(mem - meta_size, SUPERBLOCKSIZE + meta_size);
+        mem = map_aligned(SUPERBLOCKSIZE, SUPERBLOCKSIZE, meta_size);
+    }
+#endif
+
+#ifdef BUDDY_HUGEPAGES
+    if (mem != BNULL)
+    {
+        (void) madvise(mem, SUPERBLOCKSIZE, MADV_HUGEPAGE);
+    }
+#endif
+    return mem;
+}
+
+// map a new superblock for `heap`, the returned block
+// spans all of it and is not in any free list
+static struct block *grow(struct heap *heap)
+{
+    struct block *block = map_superblock();
+
+    if (block == BNULL)
+    {
+        return BNULL;
+    }
+
+    DESCRIPTOR(block)->kind = BLOCK_USED;
+#ifdef REMOTE_HEAPS
+    DESCRIPTOR(block)->heap = (unsigned) (heap - heaps);
+#endif
+#ifdef BUDDY_NUMA
+    bind_local(block, SUPERBLOCKSIZE);
+#endif
+    mark_used(block, BUDDY_SUPERBLOCK_ORDER);
+
+    DESCRIPTOR(block)->prev = BNULL;
+    DESCRIPTOR(block)->next = heap->superblocks;
+    if (heap->superblocks != BNULL)
+    {
+        DESCRIPTOR(heap->superblocks)->prev = block;
+    }
+    heap->superblocks = block;
+
+    STAT_ADD(heap, grows, 1);
+    STAT_ADD(heap, heap, SUPERBLOCKSIZE);
+    return block;
+}
+
+// the lock of its heap must be held
+static void unmap_superblock(struct block *block)
+{
+    struct superblock *desc = DESCRIPTOR(block);
+    struct heap *heap = HEAP_OF(block);
+
+    if (desc->prev != BNULL)
+    {
+        DESCRIPTOR(desc->prev)->next = desc->next;
+    }
+    else
+    {
+        heap->superblocks = desc->next;
+    }
+
+    if (desc->next != BNULL)
+    {
+        DESCRIPTOR(desc->next)->prev = desc->prev;
+    }
+
+    STAT_ADD(heap, heap, -SUPERBLOCKSIZE);
+    (void) munmap((byte_t *) block - meta_size, SUPERBLOCKSIZE + meta_size);
+}
+
+// allocations that don't fit in a superblock get
+// a mapping of their own
+static struct block *map_block(size_t size)
+{
+    // aligned like a superblock so DESCRIPTOR finds the
+    // descriptor in the page below
+    size_t map_size = ALIGNUP(BLOCKSIZE(size), pagesize);
+    struct block *block = map_aligned(map_size, SUPERBLOCKSIZE, pagesize);
+
+    if (block == BNULL)
+    {
+        return BNULL;
+    }
+
+#ifdef BUDDY_HUGEPAGES
+    if (map_size >= HUGEPAGESIZE)
+    {
+        (void) madvise(block, map_size, MADV_HUGEPAGE);
+    }
+#endif
+    DESCRIPTOR(block)->size = map_size;
+    DESCRIPTOR(block)->kind = BLOCK_MAPPED;
+#ifndef BUDDY_OOB_METADATA
+    block->used = BLOCK_MAPPED;
+#endif
+    STAT_ADD_LARGE(large_blocks, 1);
+    STAT_ADD_LARGE(large_bytes, map_size);
+    return block;
+}
+
+#ifdef BUDDY_PROFILE
+// a sample interval, exponentially distributed with a mean of
+// profile_rate bytes, so that every byte is as likely to be
+// sampled. -ln(u) is found from a quick log2, so no libm
+static int64_t sample_interval(void)
+{
+    uint64_t q;
+    unsigned e;
+    double x, log2_q;
+
+    // xorshift64
+    sampler.rng ^= sampler.rng << 13;
+    sampler.rng ^= sampler.rng >> 7;
+    sampler.rng ^= sampler.rng << 17;
+
+    // u = q / 2^53 in (0, 1], and log2(1 + x) is close to
+    // x (1.3466 - 0.3466 x) for x in [0, 1)
+    q = (sampler.rng >> 11) + 1;
+    e = 63 - __builtin_clzll(q);
+    x = (double) q / (double) ((uint64_t) 1 << e) - 1;
+    log2_q = e + x * (1.3465735903 - 0.3465735903 * x);
+
+    return (int64_t) ((53 - log2_q) * 0.6931471805599453 *
+                      (double) profile_rate) + 1;
+}
+
+// the slow path of sample_due
+static __attribute__((noinline)) int sample_next(size_t size)
+{
+    if (profile_rate == 0)
+    {
+        sampler.countdown = INT64_MAX;
+        return 0;
+    }
+
+    if (sampler.busy)
+    {
+        return 0;
+    }
+
+    // the first interval of this thread, drawn now so that
+    // its first allocation isn't always sampled
+    if (sampler.rng == 0)
+    {
+        sampler.rng = (uint64_t) (uintptr_t) &sampler *
+                      0x9e3779b97f4a7c15ull | 1;
+        sampler.countdown = sample_interval() - (int64_t) size;
+        if (sampler.countdown >= 0)
+        {
+            return 0;
+        }
+    }
+
+    sampler.countdown = sample_interval();
+    return 1;
+}
+
+// count `size` bytes as allocated, returns whether to sample them
+static int sample_due(size_t size)
+{
+    sampler.countdown -= (int64_t) size;
+    if (__builtin_expect(sampler.countdown >= 0, 1))
+    {
+        return 0;
+    }
+
+    return sample_next(size);
+}
+
+// map a block of `size` bytes and keep a sample of it. not
+// inlined, so the first frame of the backtrace is always this
+static __attribute__((noinline)) struct block *map_sample(size_t size)
+{
+    struct block *block = map_block(size);
+    struct sample *sample;
+
+    if (block == BNULL)
+    {
+        return BNULL;
+    }
+
+    sample = SAMPLE(block);
+    sample->size = size;
+    sampler.busy = 1;
+    sample->depth = backtrace(sample->frames, BUDDY_PROFILE_DEPTH);
+    sampler.busy = 0;
+    DESCRIPTOR(block)->sampled = 1;
+
+    profile_lock();
+    sample->prev = BNULL;
+    sample->next = samples;
+    if (samples != BNULL)
+    {
+        samples->prev = sample;
+    }
+    samples = sample;
+    profile_unlock();
+    return block;
+}
+
+// forget the sample of mapped `block`
+static void unlink_sample(struct block *block)
+{
+    struct sample *sample = SAMPLE(block);
+
+    profile_lock();
+    if (sample->prev != BNULL)
+    {
+        sample->prev->next = sample->next;
+    }
+    else
+    {
+        samples = sample->next;
+    }
+    if (sample->next != BNULL)
+    {
+        sample->next->prev = sample->prev;
+    }
+    profile_unlock();
+}
+#endif
+
+static void unmap_block(struct block *block)
+{
+#ifdef BUDDY_PROFILE
+    if (DESCRIPTOR(block)->sampled)
+    {
+        unlink_sample(block);
+    }
+#endif
+    STAT_ADD_LARGE(large_blocks, -1);
+    STAT_ADD_LARGE(large_bytes, -DESCRIPTOR(block)->size);
+    (void) munmap((byte_t *) block - pagesize,
+                  DESCRIPTOR(block)->size + pagesize);
+}
+
+// split used `block` of order `order` in half, the
+// upper half is made available
+static void split(struct block *block, unsigned order, int purged)
+{
+    struct block *next = NEXT(block, order - 1);
+
+    mark_split(block, order);
+    push_free(next, order - 1);
+    set_purged(next, order - 1, purged);
+    STAT_ADD(HEAP_OF(block), splits, 1);
+}
+
+// coalesce `block` of order `order` with its free buddies
+// and make the result available
+static struct block *join(struct block *block, unsigned order)
+{
+    struct block *buddy;
+
+    // stop at the root of the buddy tree
+    while (order < BUDDY_SUPERBLOCK_ORDER)
+    {
+        buddy = BUDDY(block, order);
+
+        if (!is_free(buddy, order))
+        {
+            break;
+        }
+
+        unlink_free(buddy, order);
+        if (buddy < block)
+        {
+            block = buddy;
+        }
+        order++;
+        mark_joined(block, order);
+        STAT_ADD(HEAP_OF(block), joins, 1);
+    }
+
+    push_free(block, order);
+    set_purged(block, order, PAGES_DIRTY);
+
+#ifndef BUDDY_NO_TRIM
+    if (((size_t) 1 << order) >= BUDDY_TRIM_THRESHOLD)
+    {
+        HEAP_OF(block)->trim_pending = 1;
+    }
+#endif
+
+    return block;
+}
+
+// give the pages of a free block back to the os, except
+// for the first one which holds the links, or the first
+// huge page with BUDDY_HUGEPAGES
+static size_t purge(struct block *block, unsigned order)
+{
+    size_t size = (size_t) 1 << order;
+
+    if (size <= PURGE_KEEP || get_purged(block, order))
+    {
+        return 0;
+    }
+
+    (void) madvise((byte_t *) block + PURGE_KEEP, size - PURGE_KEEP,
+                   TRIM_ADVICE);
+    set_purged(block, order, TRIM_PAGES);
+    return size - PURGE_KEEP;
+}
+
+// purge free blocks of at least order `min_order` in `heap` and
+// unmap superblocks that are entirely free, its lock must be held
+static size_t trim(struct heap *heap, unsigned min_order)
+{
+    struct block *block, *next;
+    size_t released = 0;
+
+    for (unsigned order = min_order;
+         order <= BUDDY_SUPERBLOCK_ORDER;
+         order++)
+    {
+        for (block = heap->free_lists[order]; block != BNULL; block = next)
+        {
+            next = LINKS(block)->next;
+
+            if (order == BUDDY_SUPERBLOCK_ORDER)
+            {
+                unlink_free(block, order);
+                unmap_superblock(block);
+                released += SUPERBLOCKSIZE;
+            }
+            else
+            {
+                released += purge(block, order);
+            }
+        }
+    }
+
+    STAT_ADD(heap, released, released);
+    return released;
+}
+
+// the block of its superblock that `ptr` is in, and set `*order`
+// to its order. the lock of its heap must be held
+static struct block *block_containing(void *ptr, unsigned *order)
+{
+    struct block *block = (struct block *) SUPERBLOCK(ptr);
+    unsigned found = BUDDY_SUPERBLOCK_ORDER;
+
+    // down the buddy tree, to the half `ptr` is in
+    while (is_split(block, found))
+    {
+        found--;
+        if ((uintptr_t) ptr & ((uintptr_t) 1 << found))
+        {
+            block = NEXT(block, found);
+        }
+    }
+
+    *order = found;
+    return block;
+}
+
+// the bytes of the free blocks in superblock `base`,
+// the lock of its heap must be held
+static size_t superblock_free(struct block *base)
+{
+    byte_t *end = (byte_t *) base + SUPERBLOCKSIZE;
+    struct block *block = base;
+    size_t free = 0;
+    unsigned order;
+
+    while ((byte_t *) block < end)
+    {
+        block = block_containing(block, &order);
+        if (is_free(block, order))
+        {
+            free += (size_t) 1 << order;
+        }
+        block = NEXT(block, order);
+    }
+
+    return free;
+}
+
+// trim `heap` if large blocks were freed, but at most once
+// per BUDDY_TRIM_DECAY_MS, its lock must be held
+static void maybe_trim(struct heap *heap)
+{
+#ifndef BUDDY_NO_TRIM
+    struct timespec ts;
+    uint64_t now;
+
+    if (!heap->trim_pending)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+
+    if (now < heap->last_trim + BUDDY_TRIM_DECAY_MS)
+    {
+        return;
+    }
+
+    (void) trim(heap, __builtin_ctzll(BUDDY_TRIM_THRESHOLD));
+    heap->trim_pending = 0;
+    heap->last_trim = now;
+#else
+    (void) heap;
+#endif
+}
+
+// allocate a block of order `order` from `heap`, and set `*pages`
+// to its PAGES_* state unless it is BNULL. its lock must be held
+static struct block *alloc_block(struct heap *heap, unsigned order,
+                                 int *pages)
+{
+    // take the smallest free block that fits allocation,
+    // or grow if there is none
+    unsigned found = order;
+    struct block *block = pop_free(heap, &found);
+    int purged;
+
+    if (block == BNULL)
+    {
+        block = grow(heap);
+        if (block == BNULL)
+        {
+            // can't grow
+            return BNULL;
+        }
+        found = BUDDY_SUPERBLOCK_ORDER;
+        // fresh mappings are not resident
+        purged = PAGES_ZERO;
+    }
+    else
+    {
+        purged = get_purged(block, found);
+    }
+
+    // split until we have best fit
+    while (found > order)
+    {
+        split(block, found--, purged);
+    }
+
+    if (pages != BNULL)
+    {
+        *pages = purged;
+    }
+
+    mark_used(block, order);
+    return block;
+}
+
+#ifdef BUDDY_SLAB
+
+// set or clear the bit of the slab at `block`. the bits are
+// read without the lock, so they are updated atomically
+static void mark_slab(struct block *block, int slab)
+{
+    uint64_t *bits = DESCRIPTOR(block)->slabs;
+    size_t n = BYTEDIFF(SUPERBLOCK(block), block) >> BUDDY_SLAB_ORDER;
+    uint64_t mask = (uint64_t) 1 << (n % 64);
+
+    if (slab)
+    {
+        (void) __atomic_fetch_or(&bits[n / 64], mask, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        (void) __atomic_fetch_and(&bits[n / 64], ~mask, __ATOMIC_RELAXED);
+    }
+}
+
+// whether `ptr` is an object in a slab. the bit of a slab
+// doesn't change while it holds objects, so this needs no lock
+static int is_slab(void *ptr)
+{
+    struct superblock *desc = DESCRIPTOR(ptr);
+    size_t n = BYTEDIFF(SUPERBLOCK(ptr), ptr) >> BUDDY_SLAB_ORDER;
+
+    return desc->kind == BLOCK_USED &&
+           (__atomic_load_n(&desc->slabs[n / 64], __ATOMIC_RELAXED) >>
+            (n % 64)) & 1;
+}
+
+// whether no object can be taken from `slab`
+static int slab_full(struct slab *slab)
+{
+    return slab->free == BNULL &&
+           slab->front + slab_sizes[slab->size_class] > slab->end;
+}
+
+static void slab_link(struct slab *slab)
+{
+    struct heap *heap = HEAP_OF(slab);
+
+    slab->prev = BNULL;
+    slab->next = heap->partial_slabs[slab->size_class];
+
+    if (slab->next != BNULL)
+    {
+        slab->next->prev = slab;
+    }
+
+    heap->partial_slabs[slab->size_class] = slab;
+}
+
+static void slab_unlink(struct slab *slab)
+{
+    if (slab->prev != BNULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        HEAP_OF(slab)->partial_slabs[slab->size_class] = slab->next;
+    }
+
+    if (slab->next != BNULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// cut a new slab for size class `size_class` out of
+// `heap`, its lock must be held
+static struct slab *slab_create(struct heap *heap, unsigned size_class)
+{
+    struct block *block = alloc_block(heap, BUDDY_SLAB_ORDER, BNULL);
+    struct slab *slab;
+
+    if (block == BNULL)
+    {
+        return BNULL;
+    }
+
+    mark_slab(block, 1);
+
+    slab = MEM(block);
+    slab->free = BNULL;
+    slab->front = (byte_t *) slab + ALIGNUP(sizeof(*slab),
+                                            _Alignof(max_align_t));
+    slab->end = (byte_t *) block + SLABSIZE;
+    slab->used = 0;
+    slab->size_class = size_class;
+    slab_link(slab);
+    STAT_ADD(heap, slabs, 1);
+    return slab;
+}
+
+// give an empty slab back to the buddy heap, its lock must be held
+static void slab_destroy(struct slab *slab)
+{
+    struct block *block = BLOCK(slab);
+
+    slab_unlink(slab);
+    mark_slab(block, 0);
+    STAT_ADD(HEAP_OF(block), slabs, -1);
+    (void) join(block, BUDDY_SLAB_ORDER);
+}
+
+// allocate an object of size class `size_class` from `heap`,
+// its lock must be held
+static void *slab_alloc(struct heap *heap, unsigned size_class)
+{
+    struct slab *slab = heap->partial_slabs[size_class];
+    void *ptr;
+
+    if (slab == BNULL)
+    {
+        slab = slab_create(heap, size_class);
+        if (slab == BNULL)
+        {
+            return BNULL;
+        }
+    }
+
+    if (slab->free != BNULL)
+    {
+        ptr = slab->free;
+        slab->free = *(void **) ptr;
+    }
+    else
+    {
+        ptr = slab->front;
+        slab->front += slab_sizes[size_class];
+    }
+
+    slab->used++;
+    if (slab_full(slab))
+    {
+        slab_unlink(slab);
+    }
+
+    return ptr;
+}
+
+// the lock of its heap must be held
+static void slab_free(void *ptr)
+{
+    struct slab *slab = SLAB(ptr);
+
+    if (slab_full(slab))
+    {
+        slab_link(slab);
+    }
+
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    slab->used--;
+
+    // keep an empty slab if it is the last one of its class,
+    // so that a class going back and forth between zero and
+    // one objects doesn't make a new slab every time
+    if (slab->used == 0 && (slab->prev != BNULL || slab->next != BNULL))
+    {
+        slab_destroy(slab);
+    }
+}
+
+// give the empty slabs kept by slab_free back to
+// `heap`, its lock must be held
+static void slab_trim(struct heap *heap)
+{
+    struct slab *slab, *next;
+
+    for (unsigned size_class = 0; size_class < SLAB_NCLASSES; size_class++)
+    {
+        for (slab = heap->partial_slabs[size_class]; slab != BNULL;
+             slab = next)
+        {
+            next = slab->next;
+            if (slab->used == 0)
+            {
+                slab_destroy(slab);
+            }
+        }
+    }
+}
+
+#endif
+
+#ifdef REMOTE_HEAPS
+// whether `heap` belongs to another node than the one
+// the calling thread last ran on, or to another thread
+static int is_remote(struct heap *heap)
+{
+    if (thread_heap == BNULL)
+    {
+        (void) local_heap();
+    }
+
+    return heap != thread_heap;
+}
+
+// queue `ptr`, a slab object or the memory of a block, for
+// `heap` to take back, instead of contending for its lock.
+// a single push, whoever owns the heap
+static void remote_free(struct heap *heap, void *ptr)
+{
+    void *head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+
+    do
+    {
+        *(void **) ptr = head;
+    }
+    while (!__atomic_compare_exchange_n(&heap->remote, &head, ptr, 1,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+// take back everything queued for `heap` at once,
+// its lock must be held
+static void drain_remote(struct heap *heap)
+{
+    void *ptr = __atomic_exchange_n(&heap->remote, BNULL, __ATOMIC_ACQUIRE);
+    void *next;
+
+    for (; ptr != BNULL; ptr = next)
+    {
+        next = *(void **) ptr;
+#ifdef BUDDY_SLAB
+        if (is_slab(ptr))
+        {
+            slab_free(ptr);
+            continue;
+        }
+#endif
+        (void) join(BLOCK(ptr), block_order(BLOCK(ptr)));
+    }
+}
+#endif
+
+// lock `heap`, taking back what other nodes or threads freed to it
+static void lock_heap(struct heap *heap)
+{
+    pthread_mutex_lock(&heap->lock);
+#ifdef REMOTE_HEAPS
+    if (__atomic_load_n(&heap->remote, __ATOMIC_RELAXED) != BNULL)
+    {
+        drain_remote(heap);
+    }
+#endif
+}
+
+#ifndef BUDDY_NO_TCACHE
+
+// take an object for bin `index` from `heap`, its lock must be held
+static void *bin_alloc(struct heap *heap, unsigned index)
+{
+#ifdef BUDDY_SLAB
+    return slab_alloc(heap, index);
+#else
+    struct block *block = alloc_block(heap, MINORDER + index, BNULL);
+    return block == BNULL ? BNULL : MEM(block);
+#endif
+}
+
+// give an object of bin `index` back to its heap,
+// the lock of which must be held
+static void bin_free(void *ptr, unsigned index)
+{
+#ifdef BUDDY_SLAB
+    (void) index;
+    slab_free(ptr);
+#else
+    (void) join(BLOCK(ptr), MINORDER + index);
+#endif
+}
+
+static void tcache_flush(unsigned index, unsigned count)
+{
+    struct tcache_bin *bin = &tcache.bins[index];
+    struct heap *heap = BNULL, *owner;
+    void *ptr;
+
+    // the objects are of the heaps the thread ran on when
+    // it filled the bin, which is almost always just one
+    while (count-- > 0 && bin->head != BNULL)
+    {
+        ptr = bin->head;
+        owner = HEAP_OF(ptr);
+        if (owner != heap)
+        {
+            if (heap != BNULL)
+            {
+                maybe_trim(heap);
+                pthread_mutex_unlock(&heap->lock);
+            }
+            heap = owner;
+            lock_heap(heap);
+        }
+        bin->head = *(void **) ptr;
+        bin->count--;
+        bin_free(ptr, index);
+    }
+
+    if (heap != BNULL)
+    {
+        STAT_ADD(heap, flushes, 1);
+        maybe_trim(heap);
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+static void tcache_fill(unsigned index)
+{
+    struct tcache_bin *bin = &tcache.bins[index];
+    struct heap *heap = local_heap();
+    unsigned count = TCACHE_BATCH(index);
+    void *ptr;
+
+    lock_heap(heap);
+    while (count-- > 0)
+    {
+        ptr = bin_alloc(heap, index);
+        if (ptr == BNULL)
+        {
+            break;
+        }
+        *(void **) ptr = bin->head;
+        bin->head = ptr;
+        bin->count++;
+    }
+    STAT_ADD(heap, fills, 1);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// give all cached objects back to the heap
+static void tcache_flush_all(void)
+{
+    for (unsigned i = 0; i < TCACHE_NBINS; i++)
+    {
+        tcache_flush(i, tcache.bins[i].count);
+    }
+}
+
+// drain the cache when a thread exits
+static void tcache_drain(void *arg)
+{
+    (void) arg;
+
+    tcache_flush_all();
+
+    // the thread may still call balloc / bfree from
+    // other destructors, bypass the cache from now on
+    tcache.state = TCACHE_DEAD;
+}
+
+static void tcache_create_key(void)
+{
+    (void) pthread_key_create(&tcache_key, tcache_drain);
+}
+
+// returns 0 if the cache can not be used by this thread
+static int tcache_init(void)
+{
+    if (tcache.state == TCACHE_UNINIT)
+    {
+        pthread_once(&tcache_once, tcache_create_key);
+        // the value only has to be non-null
+        // for the destructor to run
+        (void) pthread_setspecific(tcache_key, &tcache);
+        tcache.state = TCACHE_ACTIVE;
+    }
+
+    return tcache.state == TCACHE_ACTIVE;
+}
+
+// returns BNULL when the heap can't grow
+static void *tcache_alloc(unsigned index)
+{
+    struct tcache_bin *bin = &tcache.bins[index];
+    void *ptr;
+
+    if (bin->head == BNULL)
+    {
+        tcache_fill(index);
+        if (bin->head == BNULL)
+        {
+            return BNULL;
+        }
+    }
+
+    ptr = bin->head;
+    bin->head = *(void **) ptr;
+    bin->count--;
+    return ptr;
+}
+
+static void tcache_free(void *ptr, unsigned index)
+{
+    struct tcache_bin *bin = &tcache.bins[index];
+
+    *(void **) ptr = bin->head;
+    bin->head = ptr;
+
+    if (++bin->count > TCACHE_LIMIT(index))
+    {
+        tcache_flush(index, TCACHE_BATCH(index));
+    }
+}
+
+#endif
+
+// allocate `size` bytes from a buddy block, or a mapping
+// of its own, never from a slab
+static void *alloc_buddy(size_t size)
+{
+    struct block *block;
+    struct heap *heap;
+    unsigned order = order_of(size);
+
+#ifdef BUDDY_PROFILE
+    if (sample_due(size))
+    {
+        block = map_sample(size);
+        return block == BNULL ? BNULL :
+               count_alloc(MEM(block), mapped_size(block));
+    }
+#endif
+
+    if (order > BUDDY_SUPERBLOCK_ORDER)
+    {
+        block = map_block(size);
+        return block == BNULL ? BNULL :
+               count_alloc(MEM(block), mapped_size(block));
+    }
+
+#if !defined(BUDDY_NO_TCACHE) && !defined(BUDDY_SLAB)
+    if (order <= BUDDY_TCACHE_MAX_ORDER && tcache_init())
+    {
+        return count_alloc(tcache_alloc(order - MINORDER), MEMSIZE(order));
+    }
+#endif
+
+    heap = local_heap();
+    lock_heap(heap);
+    block = alloc_block(heap, order, BNULL);
+    pthread_mutex_unlock(&heap->lock);
+    return block == BNULL ? BNULL : count_alloc(MEM(block), MEMSIZE(order));
+}
+
+// the block holding `ptr`, which is not a slab object
+static struct block *block_of(void *ptr)
+{
+    struct block *block = BLOCK(ptr);
+
+#ifndef BUDDY_OOB_METADATA
+    // moved up by baligned_alloc, `size` is the
+    // distance back to the real header
+    if (block->used == BLOCK_ALIGNED)
+    {
+        block = (struct block *) ((byte_t *) block - block->size);
+    }
+#endif
+
+    return block;
+}
+
+// the block holding `ptr`, which is being freed. the block
+// may be handed out again as it is, by the thread cache, so
+// it no longer counts as moved
+static struct block *freed_block_of(void *ptr)
+{
+    struct block *block = block_of(ptr);
+
+#ifndef BUDDY_OOB_METADATA
+    if (block->used == BLOCK_MOVED)
+    {
+        block->used = BLOCK_USED;
+    }
+#endif
+
+    return block;
+}
+
+// allocate `size` bytes from wherever fits best. this is
+// balloc without the checks, and unlike balloc, compilers
+// don't know it as malloc, so they won't fold it and a
+// memset into a call to calloc within bcalloc
+static void *alloc_any(size_t size)
+{
+#ifdef BUDDY_SLAB
+    if (size <= BUDDY_SLAB_MAX)
+    {
+        unsigned size_class = SLAB_CLASS(size);
+        struct heap *heap;
+        void *ptr;
+
+#ifdef BUDDY_PROFILE
+        if (sample_due(size))
+        {
+            struct block *block = map_sample(size);
+
+            return block == BNULL ? BNULL :
+                   count_alloc(MEM(block), mapped_size(block));
+        }
+#endif
+
+#ifndef BUDDY_NO_TCACHE
+        if (tcache_init())
+        {
+            return count_alloc(tcache_alloc(size_class),
+                               slab_sizes[size_class]);
+        }
+#endif
+
+        heap = local_heap();
+        lock_heap(heap);
+        ptr = slab_alloc(heap, size_class);
+        pthread_mutex_unlock(&heap->lock);
+        return count_alloc(ptr, slab_sizes[size_class]);
+    }
+#endif
+
+    return alloc_buddy(size);
+}
+
+#ifdef BUDDY_SLAB
+// free `ptr`, an object in a slab
+static void free_object(void *ptr)
+{
+    struct heap *heap = HEAP_OF(ptr);
+
+    count_free(slab_sizes[SLAB(ptr)->size_class]);
+
+#ifdef REMOTE_HEAPS
+    if (is_remote(heap))
+    {
+        remote_free(heap, ptr);
+        return;
+    }
+#endif
+
+#ifndef BUDDY_NO_TCACHE
+    if (tcache_init())
+    {
+        tcache_free(ptr, SLAB(ptr)->size_class);
+        return;
+    }
+#endif
+
+    lock_heap(heap);
+    slab_free(ptr);
+    maybe_trim(heap);
+    pthread_mutex_unlock(&heap->lock);
+}
+#endif
+
+// free `block` of order `order` in a superblock
+static void free_block(struct block *block, unsigned order)
+{
+    struct heap *heap = HEAP_OF(block);
+
+    // catches some double frees, blocks in thread caches
+    // and quarantine still look used
+    assert(!is_free(block, order));
+    count_free(MEMSIZE(order));
+
+#ifdef REMOTE_HEAPS
+    if (is_remote(heap))
+    {
+        remote_free(heap, MEM(block));
+        return;
+    }
+#endif
+
+#if !defined(BUDDY_NO_TCACHE) && !defined(BUDDY_SLAB)
+    if (order <= BUDDY_TCACHE_MAX_ORDER && tcache_init())
+    {
+        tcache_free(MEM(block), order - MINORDER);
+        return;
+    }
+#endif
+
+    lock_heap(heap);
+    (void) join(block, order);
+    maybe_trim(heap);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// free `ptr` from alloc_any, which is not BNULL
+static void free_any(void *ptr)
+{
+#ifdef BUDDY_SLAB
+    if (is_slab(ptr))
+    {
+        free_object(ptr);
+        return;
+    }
+#endif
+
+    struct block *block = freed_block_of(ptr);
+
+    if (is_mapped(block))
+    {
+        count_free(mapped_size(block));
+        unmap_block(block);
+        return;
+    }
+
+    free_block(block, block_order(block));
+}
+
+#ifdef BUDDY_DEBUG
+// The checked mode puts a header in front of every allocation
+// and a canary right after it, both derived from the address,
+// the size and a secret. The underlying memory comes from
+// alloc_any, or with a guard page from a mapping of its own,
+// and freed memory can be held in a quarantine filled with
+// DEBUG_JUNK before it is reused
+
+// the words free lists and caches write to once the memory
+// is freed come first, so the canary outlives them
+struct debug_header {
+    size_t offset;      // from the start of the underlying memory
+    size_t length;      // of the mapping with a guard page, or 0
+    size_t size;        // asked for
+    uint64_t canary;
+};
+
+#define DEBUG_HEADER(ptr) ((struct debug_header *) (ptr) - 1)
+#define DEBUG_JUNK 0xdf
+
+// report that `op` was given a bad `ptr` and abort. stdio
+// may allocate, so the message is written as it is
+static void debug_fail(const char *op, const char *what, void *ptr)
+{
+    const char *parts[] = { "buddy.h: ", op, what, " at 0x" };
+    char msg[256];
+    size_t len = 0;
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        for (const char *c = parts[i]; *c != '\0' && len < 200; c++)
+        {
+            msg[len++] = *c;
+        }
+    }
+
+    len += format_num(msg + len, (uintptr_t) ptr, 16);
+    msg[len++] = '\n';
+    if (write(2, msg, len) < 0)
+    {
+        // nothing left to tell
+    }
+    abort();
+}
+
+// the canary of `ptr` with `size` bytes, SIZE_MAX once freed
+static uint64_t debug_canary(void *ptr, size_t size)
+{
+    uint64_t x = ((uintptr_t) ptr ^ debug_secret) +
+                 size * 0x9e3779b97f4a7c15;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// the header of `ptr`, given to `op`, if the canaries of
+// a live allocation are intact
+static struct debug_header *debug_check(void *ptr, const char *op)
+{
+    struct debug_header *header = DEBUG_HEADER(ptr);
+    uint64_t canary;
+
+    if (header->canary == debug_canary(ptr, SIZE_MAX))
+    {
+        debug_fail(op, " of freed memory", ptr);
+    }
+
+    if (header->canary != debug_canary(ptr, header->size))
+    {
+        debug_fail(op, " of memory with a bad header", ptr);
+    }
+
+    memcpy(&canary, (byte_t *) ptr + header->size, sizeof(canary));
+    if (canary != header->canary)
+    {
+        debug_fail(op, " of memory written past its end", ptr);
+    }
+
+    return header;
+}
+
+static void *debug_alloc(size_t align, size_t size)
+{
+    // room for the header, the canary after the memory
+    // and moving up to the alignment
+    size_t need = size + sizeof(struct debug_header) + sizeof(uint64_t) +
+                  (align > _Alignof(max_align_t) ?
+                   align - _Alignof(max_align_t) : 0);
+    struct debug_header *header;
+    size_t length = 0;
+    byte_t *base, *ptr;
+
+    if (need > MAXMEMSIZE)
+    {
+        return BNULL;
+    }
+
+    if (align < _Alignof(max_align_t))
+    {
+        align = _Alignof(max_align_t);
+    }
+
+    if (debug_guard > 0 && size >= debug_guard)
+    {
+        // end the memory, and its canary, as close to a
+        // page without access as the alignment allows
+        length = ALIGNUP(need + _Alignof(max_align_t), pagesize) + pagesize;
+        base = mmap(BNULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            return BNULL;
+        }
+
+        (void) mprotect(base + length - pagesize, pagesize, PROT_NONE);
+        ptr = base + length - pagesize - sizeof(uint64_t) - size;
+        ptr = (byte_t *) ((uintptr_t) ptr & ~(uintptr_t) (align - 1));
+    }
+    else
+    {
+        base = alloc_any(need);
+        if (base == BNULL)
+        {
+            return BNULL;
+        }
+
+        ptr = (byte_t *) ALIGNUP((uintptr_t) base + sizeof(*header), align);
+    }
+
+    header = DEBUG_HEADER(ptr);
+    header->offset = BYTEDIFF(base, ptr);
+    header->length = length;
+    header->size = size;
+    header->canary = debug_canary(ptr, size);
+    memcpy(ptr + size, &header->canary, sizeof(header->canary));
+    return ptr;
+}
+
+// the pages of freed `ptr` with a guard page that stay mapped,
+// read only, for its header to tell later frees it was freed
+static byte_t *debug_header_pages(void *ptr, size_t *length)
+{
+    uintptr_t start = (uintptr_t) DEBUG_HEADER(ptr) &
+                      ~(uintptr_t) (pagesize - 1);
+
+    *length = ALIGNUP((uintptr_t) ptr, pagesize) - start;
+    return (byte_t *) start;
+}
+
+// the bytes of `header` the quarantine counts, none for memory
+// with a guard page, of which only the header pages are left
+static size_t debug_held(struct debug_header *header)
+{
+    return header->length > 0 ? 0 : header->size;
+}
+
+// give the memory of `ptr`, out of quarantine, back
+static void debug_release(void *ptr)
+{
+    struct debug_header *header = DEBUG_HEADER(ptr);
+    byte_t *junk = ptr;
+    size_t length;
+
+    if (header->length > 0)
+    {
+        junk = debug_header_pages(ptr, &length);
+        (void) munmap(junk, length);
+        return;
+    }
+
+    // the canary after the memory was filled too
+    for (size_t i = 0; i < header->size + sizeof(uint64_t); i++)
+    {
+        if (junk[i] != DEBUG_JUNK)
+        {
+            debug_fail("bfree", " of memory written after it was freed",
+                       ptr);
+        }
+    }
+
+    free_any(junk - header->offset);
+}
+
+static void debug_free(void *ptr, const char *op)
+{
+    struct debug_header *header = debug_check(ptr, op);
+    byte_t *base = (byte_t *) ptr - header->offset;
+    byte_t *end = base + header->length;
+    byte_t *kept;
+    void *evicted[8];
+    size_t count = 0;
+    size_t length;
+
+    header->canary = debug_canary(ptr, SIZE_MAX);
+
+    if (header->length > 0)
+    {
+        // later accesses fault, unless the range is mapped again,
+        // but for the pages of the header, kept readable in
+        // quarantine even without BUDDY_DEBUG_QUARANTINE so
+        // that double frees are reported
+        kept = debug_header_pages(ptr, &length);
+        if (kept > base)
+        {
+            (void) munmap(base, BYTEDIFF(base, kept));
+        }
+        (void) munmap(kept + length, BYTEDIFF(kept + length, end));
+        (void) mprotect(kept, length, PROT_READ);
+    }
+    else if (debug_quarantine == 0)
+    {
+        free_any(base);
+        return;
+    }
+    else
+    {
+        memset(ptr, DEBUG_JUNK, header->size + sizeof(uint64_t));
+    }
+
+    // queue `ptr` and take out the oldest until the
+    // quarantine is within its bounds again
+    pthread_mutex_lock(&quarantine_lock);
+    quarantine[(quarantine_first + quarantine_count++) %
+               BUDDY_DEBUG_QUARANTINE_SLOTS] = ptr;
+    quarantine_bytes += debug_held(header);
+
+    while (count < sizeof(evicted) / sizeof(evicted[0]) &&
+           (quarantine_bytes > debug_quarantine ||
+            quarantine_count == BUDDY_DEBUG_QUARANTINE_SLOTS))
+    {
+        ptr = quarantine[quarantine_first];
+        quarantine_first = (quarantine_first + 1) %
+                           BUDDY_DEBUG_QUARANTINE_SLOTS;
+        quarantine_count--;
+        quarantine_bytes -= debug_held(DEBUG_HEADER(ptr));
+        evicted[count++] = ptr;
+    }
+    pthread_mutex_unlock(&quarantine_lock);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        debug_release(evicted[i]);
+    }
+}
+
+static void *debug_realloc(void *ptr, size_t size)
+{
+    struct debug_header *header = debug_check(ptr, "brealloc");
+    void *moved;
+
+    // always move, so stale pointers to the old memory
+    // show up in the quarantine
+    moved = debug_alloc(_Alignof(max_align_t), size);
+    if (moved == BNULL)
+    {
+        return BNULL;
+    }
+
+    memcpy(moved, ptr, header->size < size ? header->size : size);
+    debug_free(ptr, "brealloc");
+    return moved;
+}
+#endif
+
+void *balloc(size_t size)
+{
+    void *ptr;
+
+    if (!is_init())
+    {
+        init();
+    }
+
+    TRACE_ENTER();
+
+    if (size == 0 || size > MAXMEMSIZE)
+    {
+        ptr = BNULL;
+    }
+#ifdef BUDDY_DEBUG
+    else if (debug_mode)
+    {
+        ptr = debug_alloc(_Alignof(max_align_t), size);
+    }
+#endif
+    else
+    {
+        ptr = alloc_any(size);
+    }
+
+    TRACE_LEAVE(BUDDY_TRACE_ALLOC, ptr, BNULL, size);
+    return ptr;
+}
+
+void bfree(void *ptr)
+{
+    if (ptr == BNULL)
+    {
+        return;
+    }
+
+    TRACE_FREE(ptr, 0);
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode)
+    {
+        debug_free(ptr, "bfree");
+        return;
+    }
+#endif
+
+    free_any(ptr);
+}
+
+// free `ptr`, where the block was allocated for `size` bytes
+// and the caller used `used` of them
+static void free_hinted(void *ptr, size_t size, size_t used)
+{
+    struct block *block;
+    unsigned order;
+
+    if (ptr == BNULL)
+    {
+        return;
+    }
+
+#ifdef BUDDY_SLAB
+    // brealloc only keeps slab objects for sizes they fit,
+    // so larger ones are never in a slab
+    if (size <= BUDDY_SLAB_MAX && is_slab(ptr))
+    {
+        assert(used <= slab_sizes[SLAB(ptr)->size_class]);
+        free_object(ptr);
+        return;
+    }
+#endif
+
+    block = freed_block_of(ptr);
+
+    if (is_mapped(block))
+    {
+        assert(used <= BYTEDIFF(ptr, (byte_t *) block +
+                                     DESCRIPTOR(block)->size));
+        count_free(mapped_size(block));
+        unmap_block(block);
+        return;
+    }
+
+    // brealloc splits blocks down to the order of the new size,
+    // but keeps memory moved up by baligned_alloc as it is
+    order = order_of(size);
+    if (!has_order(block, order))
+    {
+        order = block_order(block);
+    }
+
+    assert(used <= BYTEDIFF(ptr, NEXT(block, order)));
+    free_block(block, order);
+}
+
+void bfree_sized(void *ptr, size_t size)
+{
+    TRACE_FREE(ptr, size);
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode && ptr != BNULL)
+    {
+        if (debug_check(ptr, "bfree_sized")->size != size)
+        {
+            debug_fail("bfree_sized", " with the wrong size", ptr);
+        }
+        debug_free(ptr, "bfree_sized");
+        return;
+    }
+#endif
+
+    free_hinted(ptr, size, size);
+}
+
+void bfree_aligned_sized(void *ptr, size_t align, size_t size)
+{
+    TRACE_FREE(ptr, size);
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode && ptr != BNULL)
+    {
+        if (debug_check(ptr, "bfree_aligned_sized")->size != size ||
+            ((uintptr_t) ptr & (align - 1)) != 0)
+        {
+            debug_fail("bfree_aligned_sized",
+                       " with the wrong size or alignment", ptr);
+        }
+        debug_free(ptr, "bfree_aligned_sized");
+        return;
+    }
+#endif
+
+    // the size baligned_alloc asked for
+    if (align <= _Alignof(max_align_t))
+    {
+        free_hinted(ptr, ALIGNUP(size, align), size);
+        return;
+    }
+
+#ifdef BUDDY_OOB_METADATA
+    free_hinted(ptr, size > align ? size : align, size);
+#else
+    free_hinted(ptr, size + align, size);
+#endif
+}
+
+size_t busable_size(void *ptr)
+{
+    struct block *block;
+
+    if (ptr == BNULL)
+    {
+        return 0;
+    }
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode)
+    {
+        return debug_check(ptr, "busable_size")->size;
+    }
+#endif
+
+#ifdef BUDDY_SLAB
+    if (is_slab(ptr))
+    {
+        return slab_sizes[SLAB(ptr)->size_class];
+    }
+#endif
+
+    block = block_of(ptr);
+
+    if (is_mapped(block))
+    {
+        return BYTEDIFF(ptr, (byte_t *) block + DESCRIPTOR(block)->size);
+    }
+
+    return BYTEDIFF(ptr, NEXT(block, block_order(block)));
+}
+
+// try to grow `block` of order `order` in place by joining
+// with free buddies on either side. returns the start of the
+// grown block, which is below `block` if a left buddy was
+// joined, or BNULL if it can't grow. the lock of its heap
+// must be held
+static struct block *grow_in_place(struct block *block, unsigned order,
+                                   size_t size)
+{
+    struct block *start = block, *buddy;
+    unsigned target = order;
+
+    while (MEMSIZE(target) < size)
+    {
+        buddy = BUDDY(start, target);
+
+        if (target == BUDDY_SUPERBLOCK_ORDER || !is_free(buddy, target))
+        {
+            return BNULL;
+        }
+
+        if (buddy < start)
+        {
+            start = buddy;
+        }
+        target++;
+    }
+
+    // take the buddies out of their free lists
+    start = block;
+    while (order < target)
+    {
+        buddy = BUDDY(start, order);
+        unlink_free(buddy, order);
+        if (buddy < start)
+        {
+            start = buddy;
+        }
+        order++;
+        mark_joined(start, order);
+    }
+
+    mark_used(start, target);
+    return start;
+}
+
+#ifdef MREMAP_MAYMOVE
+// resize the mapping of `block` to hold `size` bytes by
+// moving pages instead of copying them. returns the
+// resized block, or BNULL with `block` left as it was
+static struct block *remap_block(struct block *block, size_t size)
+{
+    size_t map_size = ALIGNUP(BLOCKSIZE(size), pagesize);
+    size_t old_length = DESCRIPTOR(block)->size + pagesize;
+    byte_t *base = (byte_t *) block - pagesize;
+    byte_t *mem = mremap(base, old_length, map_size + pagesize, 0);
+    byte_t *target;
+
+    if (mem == MAP_FAILED)
+    {
+        // no room to grow where it is, move it to a range
+        // aligned like a superblock so DESCRIPTOR still works
+        target = map_aligned(map_size, SUPERBLOCKSIZE, pagesize);
+        if (target == BNULL)
+        {
+            return BNULL;
+        }
+
+        mem = mremap(base, old_length, map_size + pagesize,
+                     MREMAP_MAYMOVE | MREMAP_FIXED, target - pagesize);
+        if (mem == MAP_FAILED)
+        {
+            (void) munmap(target - pagesize, map_size + pagesize);
+            return BNULL;
+        }
+    }
+
+    block = (struct block *) (mem + pagesize);
+    DESCRIPTOR(block)->size = map_size;
+    STAT_ADD_LARGE(large_bytes, map_size - (old_length - pagesize));
+    return block;
+}
+#endif
+
+// move the contents of `ptr`, which has room for `old_size`
+// bytes, to a new allocation of `size` bytes
+static void *relocate(void *ptr, size_t old_size, size_t size)
+{
+    // allocate before freeing, since the free lists
+    // live in the memory we are copying from
+    byte_t *new_ptr = balloc(size);
+
+    if (new_ptr == BNULL)
+    {
+        return BNULL;
+    }
+
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    bfree(ptr);
+    return new_ptr;
+}
+
+// brealloc, but not traced
+static void *resize(void *ptr, size_t size)
+{
+    struct block *block, *start;
+    unsigned order, current;
+    struct heap *heap;
+    size_t old_size;
+
+    if (ptr == BNULL)
+    {
+        return balloc(size);
+    }
+
+    if (size == 0)
+    {
+        bfree(ptr);
+        return BNULL;
+    }
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode)
+    {
+        return size > MAXMEMSIZE ? BNULL : debug_realloc(ptr, size);
+    }
+#endif
+
+    if (size > MAXMEMSIZE)
+    {
+        return BNULL;
+    }
+
+#ifdef BUDDY_SLAB
+    if (is_slab(ptr))
+    {
+        old_size = slab_sizes[SLAB(ptr)->size_class];
+        // keep the object unless we would waste more than half of it
+        if (old_size >= size && old_size / 2 < size)
+        {
+            return ptr;
+        }
+        return relocate(ptr, old_size, size);
+    }
+#endif
+
+    block = block_of(ptr);
+    order = order_of(size);
+
+    if (ptr != MEM(block))
+    {
+        // moved up by baligned_alloc, realloc doesn't keep
+        // the alignment so just make sure the size fits
+        old_size = is_mapped(block) ?
+            BYTEDIFF(ptr, (byte_t *) block + DESCRIPTOR(block)->size) :
+            BYTEDIFF(ptr, NEXT(block, block_order(block)));
+        return old_size >= size ? ptr : relocate(ptr, old_size, size);
+    }
+
+    if (is_mapped(block))
+    {
+        old_size = mapped_size(block);
+#ifdef BUDDY_PROFILE
+        // a new allocation, which may be sampled itself
+        if (DESCRIPTOR(block)->sampled)
+        {
+            return relocate(ptr, old_size, size);
+        }
+#endif
+        // keep the mapping unless we would waste more than half of it
+        if (old_size >= size && old_size / 2 < size)
+        {
+            return ptr;
+        }
+#ifdef MREMAP_MAYMOVE
+        if (order > BUDDY_SUPERBLOCK_ORDER)
+        {
+            block = remap_block(block, size);
+            if (block == BNULL)
+            {
+                return BNULL;
+            }
+            count_resize(old_size, mapped_size(block));
+            return MEM(block);
+        }
+#endif
+        return relocate(ptr, old_size, size);
+    }
+
+    current = block_order(block);
+    old_size = MEMSIZE(current);
+    // the block stays in its heap, even on another node
+    heap = HEAP_OF(block);
+
+    if (old_size >= size)
+    {
+        if (current > order)
+        {
+            count_resize(old_size, MEMSIZE(order));
+            lock_heap(heap);
+            while (current > order)
+            {
+                split(block, current--, PAGES_DIRTY);
+            }
+            pthread_mutex_unlock(&heap->lock);
+        }
+        return ptr;
+    }
+
+    if (order > BUDDY_SUPERBLOCK_ORDER)
+    {
+        return relocate(ptr, old_size, size);
+    }
+
+    lock_heap(heap);
+    start = grow_in_place(block, current, size);
+    pthread_mutex_unlock(&heap->lock);
+
+    if (start == BNULL)
+    {
+        return relocate(ptr, old_size, size);
+    }
+
+    count_resize(old_size, MEMSIZE(order));
+
+    // the grown block is ours, so the move needs no lock
+    if (start != block)
+    {
+        memmove(MEM(start), ptr, old_size);
+    }
+
+    return MEM(start);
+}
+
+void *brealloc(void *ptr, size_t size)
+{
+    void *new_ptr;
+
+    TRACE_ENTER();
+    new_ptr = resize(ptr, size);
+    TRACE_LEAVE(BUDDY_TRACE_REALLOC, new_ptr, ptr, size);
+    return new_ptr;
+}
+
+// bcalloc of `size` bytes in all, but not traced
+static void *alloc_zeroed(size_t size)
+{
+    struct block *block;
+    struct heap *heap;
+    unsigned order;
+    size_t clear;
+    byte_t *ptr;
+    int pages;
+
+    if (!is_init())
+    {
+        init();
+    }
+
+    if (size == 0 || size > MAXMEMSIZE)
+    {
+        return BNULL;
+    }
+
+    order = order_of(size);
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode)
+    {
+        ptr = debug_alloc(_Alignof(max_align_t), size);
+        if (ptr != BNULL)
+        {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+#endif
+
+    // small enough that clearing it all costs little
+    if (((size_t) 1 << order) <= 2 * pagesize
+#ifdef BUDDY_SLAB
+        || size <= BUDDY_SLAB_MAX
+#endif
+       )
+    {
+        ptr = alloc_any(size);
+        if (ptr != BNULL)
+        {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    // fresh mappings are zero already
+#ifdef BUDDY_PROFILE
+    if (sample_due(size))
+    {
+        block = map_sample(size);
+        return block == BNULL ? BNULL :
+               count_alloc(MEM(block), mapped_size(block));
+    }
+#endif
 
+    if (order > BUDDY_SUPERBLOCK_ORDER)
+    {
+        block = map_block(size);
+        return block == BNULL ? BNULL :
+               count_alloc(MEM(block), mapped_size(block));
+    }
 
-/**
- *  Allocate `size` bytes of memory.
- *  Returns BNULL on failure.
- */
-void *balloc(size_t size);
+    heap = local_heap();
+    lock_heap(heap);
+    block = alloc_block(heap, order, &pages);
+    pthread_mutex_unlock(&heap->lock);
 
-/**
- *  Free previously allocated memory.
- */
-void bfree(void *ptr);
+    if (block == BNULL)
+    {
+        return BNULL;
+    }
 
-/**
- *  Attempt to reallocate memory to fit new size.
- *  Returns BNULL on failure.
- */
-void *brealloc(void *ptr, size_t size);
+    // only the first page of a zeroed block was written to
+    ptr = MEM(block);
+    clear = size;
+    if (pages == PAGES_ZERO && BYTEDIFF(ptr, (byte_t *) block + pagesize) < size)
+    {
+        clear = BYTEDIFF(ptr, (byte_t *) block + pagesize);
+    }
 
-/**
- *  Allocate memory for `nitems` objects of size `size`,
- *  and zero memory. Returns BNULL on failure.
- */
-void *bcalloc(size_t nitems, size_t size);
+    memset(ptr, 0, clear);
+    return count_alloc(ptr, MEMSIZE(order));
+}
 
-#endif
+void *bcalloc(size_t nitems, size_t size)
+{
+    void *ptr;
 
+    if (__builtin_mul_overflow(nitems, size, &size))
+    {
+        return BNULL;
+    }
 
+    TRACE_ENTER();
+    ptr = alloc_zeroed(size);
+    TRACE_LEAVE(BUDDY_TRACE_ALLOC, ptr, BNULL, size);
+    return ptr;
+}
 
-#ifdef BUDDY_IMPLEMENTATION
-#undef BUDDY_IMPLEMENTATION
+// baligned_alloc, but not traced
+static void *alloc_aligned(size_t align, size_t size)
+{
+    if (!is_init())
+    {
+        init();
+    }
 
-#include <stdint.h>
-#include <unistd.h>
-#include <assert.h>
-#include <string.h>
-#include <pthread.h>
+    if (align == 0 || (align & (align - 1)) != 0 || align >= SUPERBLOCKSIZE ||
+        size == 0 || size > MAXMEMSIZE - align)
+    {
+        return BNULL;
+    }
 
-typedef uint8_t byte_t;
+#ifdef BUDDY_DEBUG
+    if (debug_mode)
+    {
+        return debug_alloc(align, size);
+    }
+#endif
 
-struct block {
-    size_t size;
-    int used;
-    _Alignas(max_align_t) byte_t mem[];
-};
+    // slab objects and block memory are aligned like
+    // max_align_t, as long as the size is a multiple of it
+    if (align <= _Alignof(max_align_t))
+    {
+        return balloc(ALIGNUP(size, align));
+    }
 
-//#ifndef BUDDY_BLOCK_INIT_SIZE
-//#define BUDDY_BLOCK_INIT_SIZE 4096
-//#endif
-//
-//_Static_assert((BUDDY_BLOCK_INIT_SIZE & (BUDDY_BLOCK_INIT_SIZE - 1)) == 0,
-//               "buddy.h: BUDDY_BLOCK_INIT_SIZE must be a power of two.");
+#ifdef BUDDY_OOB_METADATA
+    // blocks are aligned to their size, and mappings
+    // to the size of a superblock
+    return alloc_buddy(size > align ? size : align);
+#else
+    // take a block with room to move the memory up to the
+    // alignment, leaving a header in front of it which
+    // points back to the real one
+    byte_t *mem = alloc_buddy(size + align);
+    byte_t *aligned;
+    struct block *header, *block;
 
+    if (mem == BNULL || ((uintptr_t) mem & (align - 1)) == 0)
+    {
+        return mem;
+    }
 
+    aligned = (byte_t *) ALIGNUP((uintptr_t) mem + MEMOFFSET, align);
+    header = BLOCK(aligned);
+    header->size = BYTEDIFF(BLOCK(mem), header);
+    header->used = BLOCK_ALIGNED;
+    // so buddy_defragment can find the memory from the block
+    block = BLOCK(mem);
+    if (!is_mapped(block))
+    {
+        block->used = BLOCK_MOVED;
+        block->purged = (int) BYTEDIFF(mem, aligned);
+    }
+    return aligned;
+#endif
+}
 
-// find next block
-#define NEXT(block_ptr)\
-    (struct block *)((byte_t*)(block_ptr) + (block_ptr)->size)
-// the offset of the usable memory region in a block
-#define MEMOFFSET (offsetof(struct block, mem))
-// the size of usable memory `block_ptr` can hold
-#define MEMSIZE(block_ptr) (size_t)((block_ptr)->size - MEMOFFSET)
-// get pointer to block containing `mem`
-#define BLOCK(mem) (struct block *)((byte_t *)mem - MEMOFFSET)
-// the size of usable memory if we would split `block_ptr`
-#define HALFMEMSIZE(block_ptr)\
-    (size_t)((block_ptr)->size / 2 - MEMOFFSET)
-// the smallest size a block can be
-#define MINBLOCKSIZE 16
-// the size of a block that can hold `memsize` bytes
-// of usable memory
-#define BLOCKSIZE(memsize) (memsize + MEMOFFSET)
-// the byte offset between two pointers
-#define BYTEDIFF(ptr1, ptr2)\
-    (size_t) ((byte_t *) ptr2 - (byte_t *) ptr1)
-
-
-// points to the first block in memory
-static struct block *start;
-// points to the end of last block in memory
-static struct block *end;
-// points to the next block to consider for allocation
-static struct block *next;
-// lock for the whole allocator
-static pthread_mutex_t lock;
-// library initialization flag
-static int Buddy_Is_Init = 0;
+void *baligned_alloc(size_t align, size_t size)
+{
+    void *ptr;
 
-#ifdef BUDDY_STDLIB_OVERRIDE
-// we call bfree (=free when this ^^^ is defined)
-// and then use the pointer in some functions
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wuse-after-free"
-#endif
+    TRACE_ENTER();
+    ptr = alloc_aligned(align, size);
+    TRACE_LEAVE(BUDDY_TRACE_ALLOC, ptr, BNULL, size);
+    return ptr;
+}
 
-// Buddy_Is_Init is used instead of constructor, because I couldn't
-// get init() to be called before c++ global constructors, which in turn
-// call malloc.
-//__attribute__((constructor(101)))
-static void init(void)
+size_t btrim(void)
 {
-    pthread_mutexattr_t lock_attr;
-    // lock may be aquired multiple times,
-    // for example when brealloc calls balloc
-    pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&lock, &lock_attr);
-    pthread_mutex_lock(&lock);
+    size_t released = 0;
+    struct heap *heap;
 
-    if (Buddy_Is_Init)
+    if (!is_init())
     {
-        return;
+        init();
     }
 
-    // setup an inital block of size BUDDY_BLOCK_INIT_SIZE
-    start = sbrk(0);
-
-    size_t pagesize = sysconf(_SC_PAGESIZE);
+#ifndef BUDDY_NO_TCACHE
+    if (tcache.state == TCACHE_ACTIVE)
+    {
+        tcache_flush_all();
+    }
+#endif
 
-    // adjust alignment if necessary
-    if ((size_t) start % pagesize > 0)
+    for (heap = heaps; heap < heaps + NHEAPS; heap++)
     {
-        (void) sbrk(pagesize - (size_t) start % pagesize);
-        start = sbrk(0);
+        lock_heap(heap);
+#ifdef BUDDY_SLAB
+        slab_trim(heap);
+#endif
+        // anything with at least one page besides the links
+        released += trim(heap, __builtin_ctzll(pagesize) + 1);
+        pthread_mutex_unlock(&heap->lock);
     }
 
-    if (sbrk(pagesize) == (void *) -1)
+    return released;
+}
+
+void buddy_heap_walk(void (*visit)(void *ptr, size_t size, int kind,
+                                    void *arg),
+                     void *arg)
+{
+    struct block *base, *block;
+    struct heap *heap;
+    unsigned order;
+    int kind;
+
+    if (!is_init())
     {
-        assert(0 && "failed to initialize buddy.h");
+        init();
     }
-    end = (struct block *)
-        ((byte_t *) start + pagesize);
 
-    next = start;
-    next->size = pagesize;
-    next->used = 0;
-    Buddy_Is_Init = 1;
-    pthread_mutex_unlock(&lock);
+    for (heap = heaps; heap < heaps + NHEAPS; heap++)
+    {
+        lock_heap(heap);
+        for (base = heap->superblocks; base != BNULL;
+             base = DESCRIPTOR(base)->next)
+        {
+            for (block = base;
+                 (byte_t *) block < (byte_t *) base + SUPERBLOCKSIZE;
+                 block = NEXT(block, order))
+            {
+                block = block_containing(block, &order);
+                kind = is_free(block, order) ? BUDDY_BLOCK_FREE :
+                                               BUDDY_BLOCK_USED;
+#ifdef BUDDY_SLAB
+                if (kind == BUDDY_BLOCK_USED && is_slab(block))
+                {
+                    kind = BUDDY_BLOCK_SLAB;
+                }
+#endif
+                visit(MEM(block), MEMSIZE(order), kind, arg);
+            }
+        }
+        pthread_mutex_unlock(&heap->lock);
+    }
 }
 
-static struct block *grow(size_t required)
+void buddy_fragmentation(buddy_fragmentation_t *frag)
 {
-    required = BLOCKSIZE(required);
-    size_t current_size;
     struct block *block;
+    struct heap *heap;
+    size_t size;
+
+    if (!is_init())
+    {
+        init();
+    }
 
-    // if there is just one free block,
-    // just grow that
-    if (NEXT(start) == end && !start->used)
+    memset(frag, 0, sizeof(*frag));
+    for (heap = heaps; heap < heaps + NHEAPS; heap++)
     {
-        size_t size = start->size;
-        while (size < required)
+        lock_heap(heap);
+        for (block = heap->superblocks; block != BNULL;
+             block = DESCRIPTOR(block)->next)
         {
-            size *= 2;
+            frag->heap += SUPERBLOCKSIZE;
         }
 
-        if (sbrk(size - start->size) == (void *) -1)
+        for (unsigned order = MINORDER; order <= BUDDY_SUPERBLOCK_ORDER;
+             order++)
         {
-            return BNULL;
+            size = (size_t) 1 << order;
+            for (block = heap->free_lists[order]; block != BNULL;
+                 block = LINKS(block)->next)
+            {
+                frag->free_bytes += size;
+                frag->order_bytes[order] += size;
+                if (size > frag->largest_free)
+                {
+                    frag->largest_free = size;
+                }
+            }
         }
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+// a free block held back by buddy_defragment, kept in its memory
+struct withheld {
+    struct block *next;
+    unsigned order;
+};
 
-        start->size = size;
-        end = NEXT(start);
+#define WITHHELD(block_ptr) ((struct withheld *) MEM(block_ptr))
 
-        return start;
-    }
+// hold back free `block` of order `order` by linking it in at
+// `*link`, the lock of its heap must be held. returns the link
+// after it
+static struct block **withhold(struct block *block, unsigned order,
+                               struct block **link)
+{
+    unlink_free(block, order);
+    WITHHELD(block)->next = *link;
+    WITHHELD(block)->order = order;
+    *link = block;
+    return &WITHHELD(block)->next;
+}
 
-    // keep growing until last block is big enough
-    do {
-        current_size = BYTEDIFF(start, end);
+// pick the superblocks of `heap` to empty, and hold back their
+// free blocks. its lock must be held. returns the first one,
+// linked through `evacuate`
+static struct block *pick_evacuated(struct heap *heap)
+{
+    struct block *base, *block, *picked = BNULL, **link;
+    size_t room = 0, moved = 0, free;
+    unsigned order;
+
+    for (base = heap->superblocks; base != BNULL;
+         base = DESCRIPTOR(base)->next)
+    {
+        room += superblock_free(base);
+    }
 
-        if (sbrk(current_size) == (void *) -1)
+    // those mostly free, as long as what is in them
+    // still fits in the free memory of the others
+    for (base = heap->superblocks; base != BNULL;
+         base = DESCRIPTOR(base)->next)
+    {
+        free = superblock_free(base);
+        if (SUPERBLOCKSIZE - free > SUPERBLOCKSIZE / 4 ||
+            moved + SUPERBLOCKSIZE - free > room - free)
         {
-            return BNULL;
+            continue;
         }
 
-        block = end;
-        block->size = current_size;
-        block->used = 0;
+        moved += SUPERBLOCKSIZE - free;
+        room -= free;
 
-        end = NEXT(block);
+        link = &DESCRIPTOR(base)->withheld;
+        *link = BNULL;
+        for (block = base;
+             (byte_t *) block < (byte_t *) base + SUPERBLOCKSIZE;
+             block = NEXT(block, order))
+        {
+            block = block_containing(block, &order);
+            if (is_free(block, order))
+            {
+                link = withhold(block, order, link);
+            }
+        }
 
-    } while (current_size < required);
+        DESCRIPTOR(base)->evacuate = picked;
+        picked = base;
+    }
 
-    return block;
+    return picked;
 }
 
-static void split(struct block *block)
+// the memory the program holds in used `block` of order `order`,
+// and set `*size` to its usable size, as busable_size finds it.
+// returns BNULL if the program holds none of it, like memory
+// in quarantine
+static void *held_memory(struct block *block, unsigned order, size_t *size)
 {
-    block->size /= 2;
-    struct block *next = NEXT(block);
-    next->size = block->size;
-    next->used = 0;
+    byte_t *mem = MEM(block);
+
+    *size = MEMSIZE(order);
+#ifndef BUDDY_OOB_METADATA
+    if (block->used == BLOCK_MOVED)
+    {
+        mem += block->purged;
+        *size -= (size_t) block->purged;
+    }
+#endif
+
+#ifdef BUDDY_DEBUG
+    if (debug_mode)
+    {
+        struct debug_header *header;
+        byte_t *ptr;
+
+        // moved up past the header to an alignment
+        // of at least that of max_align_t
+        for (size_t align = _Alignof(max_align_t); align < *size;
+             align *= 2)
+        {
+            ptr = (byte_t *) ALIGNUP((uintptr_t) mem + sizeof(*header),
+                                     align);
+            header = DEBUG_HEADER(ptr);
+            if (BYTEDIFF(mem, ptr) + sizeof(uint64_t) > *size)
+            {
+                break;
+            }
+            if (header->offset == BYTEDIFF(mem, ptr) &&
+                header->size <= *size - BYTEDIFF(mem, ptr) &&
+                header->canary == debug_canary(ptr, header->size))
+            {
+                *size = header->size;
+                return ptr;
+            }
+        }
+        return BNULL;
+    }
+#endif
+
+    return mem;
 }
 
-static struct block *join(struct block *block)
+// offer every used block of superblock `base` to `move`,
+// and hold back what is freed. the lock of `heap` must not be held
+static void evacuate(struct heap *heap, struct block *base,
+                     void (*move)(void *ptr, size_t size, void *arg),
+                     void *arg)
 {
-    struct block *buddy, *joined;
-    size_t size = block->size;
+    struct block **link = &DESCRIPTOR(base)->withheld;
+    byte_t *cursor = (byte_t *) base, *tried = BNULL;
+    struct block *block;
+    unsigned order;
+    size_t size;
+    void *mem;
+    int kind;
 
-    for (;;)
+    while (cursor < (byte_t *) base + SUPERBLOCKSIZE)
     {
-        if (BYTEDIFF(start, block) % (size * 2) == 0)
+        // the withheld blocks are in address order
+        if (*link == (struct block *) cursor)
         {
-            buddy = (struct block *) ((byte_t *) block + size);
-            joined = block;
+            cursor = (byte_t *) NEXT(*link, WITHHELD(*link)->order);
+            link = &WITHHELD(*link)->next;
+            continue;
         }
-        else
+
+        // other threads may free and allocate in between, so
+        // the block may have been joined with those around it
+        lock_heap(heap);
+        block = block_containing(cursor, &order);
+        kind = is_free(block, order) ? BUDDY_BLOCK_FREE : BUDDY_BLOCK_USED;
+        mem = BNULL;
+        if (kind == BUDDY_BLOCK_FREE)
+        {
+            link = withhold(block, order, link);
+        }
+#ifdef BUDDY_SLAB
+        else if (is_slab(block))
         {
-            buddy = (struct block *) ((byte_t *) block - size);
-            joined = buddy;
+            kind = BUDDY_BLOCK_SLAB;
         }
+#endif
+        else if ((byte_t *) block == cursor)
+        {
+            mem = held_memory(block, order, &size);
+        }
+        pthread_mutex_unlock(&heap->lock);
 
-        if (buddy == end ||
-            buddy->size != size ||
-            buddy->used)
+        // a block that was not moved is passed over
+        if (kind != BUDDY_BLOCK_USED || mem == BNULL || cursor == tried)
         {
-            break;
+            cursor = (byte_t *) NEXT(block, order);
+            continue;
         }
-        else
+
+        tried = cursor;
+        move(mem, size, arg);
+#ifndef BUDDY_NO_TCACHE
+        // so that the block comes back if it was freed
+        if (tcache.state == TCACHE_ACTIVE)
         {
-            block = joined;
-            size *= 2;
+            tcache_flush_all();
         }
+#endif
     }
-
-    block->size = size;
-    block->used = 0;
-    return block;
 }
 
-void *balloc(size_t size)
+size_t buddy_defragment(void (*move)(void *ptr, size_t size,
+                                         void *arg),
+                        void *arg)
 {
-    if (!Buddy_Is_Init)
+    struct block *picked, *base, *block, *next;
+    size_t released = 0;
+    struct heap *heap;
+
+    if (!is_init())
     {
         init();
     }
 
-    if (size == 0)
+#ifndef BUDDY_NO_TCACHE
+    if (tcache.state == TCACHE_ACTIVE)
     {
-        return BNULL;
+        tcache_flush_all();
     }
+#endif
 
-    pthread_mutex_lock(&lock);
-
-    struct block *block = next;
-
-    // search for unused block that fits allocation
-    while (MEMSIZE(block) < size || block->used)
+    for (heap = heaps; heap < heaps + NHEAPS; heap++)
     {
+        lock_heap(heap);
+#ifdef BUDDY_SLAB
+        slab_trim(heap);
+#endif
+        picked = pick_evacuated(heap);
+        pthread_mutex_unlock(&heap->lock);
 
-        block = NEXT(block);
-
-        // wrap around
-        if (block == end)
+        // the superblocks picked can't be unmapped meanwhile,
+        // since their withheld blocks look used
+        for (base = picked; base != BNULL; base = DESCRIPTOR(base)->evacuate)
         {
-            block = start;
+            evacuate(heap, base, move, arg);
         }
 
-        // went through all available blocks
-        // try to grow
-        if (block == next)
+        lock_heap(heap);
+        for (base = picked; base != BNULL; base = DESCRIPTOR(base)->evacuate)
         {
-            block = grow(size);
-            if (block == BNULL)
+            for (block = DESCRIPTOR(base)->withheld; block != BNULL;
+                 block = next)
             {
-                // can't grow
-                pthread_mutex_unlock(&lock);
-                return BNULL;
+                next = WITHHELD(block)->next;
+                (void) join(block, WITHHELD(block)->order);
             }
-            break;
+            DESCRIPTOR(base)->withheld = BNULL;
         }
+        released += trim(heap, BUDDY_SUPERBLOCK_ORDER);
+        pthread_mutex_unlock(&heap->lock);
     }
 
-    // split until we have best fit
-    while (HALFMEMSIZE(block) >= size && block->size > MINBLOCKSIZE)
+    return released;
+}
+
+#ifdef BUDDY_STATS
+void buddy_stats(buddy_stats_t *stats)
+{
+    size_t allocated = 0, freed = 0;
+    struct stats_slot *slot;
+    struct heap *heap;
+
+    if (!is_init())
     {
-        split(block);
+        init();
     }
 
-    // record where we should start searching next
-    next = NEXT(block);
-    if (next == end)
+    // the counters of every heap, which are all size_t
+    memset(stats, 0, sizeof(*stats));
+    for (heap = heaps; heap < heaps + NHEAPS; heap++)
     {
-        next = start;
+        pthread_mutex_lock(&heap->lock);
+        for (size_t i = 0; i < sizeof(*stats) / sizeof(size_t); i++)
+        {
+            ((size_t *) stats)[i] += ((const size_t *) &heap->stats)[i];
+        }
+        pthread_mutex_unlock(&heap->lock);
     }
 
-    block->used = 1;
-    pthread_mutex_unlock(&lock);
-    return block->mem;
-}
+    stats->large_bytes = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+    stats->large_blocks = __atomic_load_n(&large_blocks, __ATOMIC_RELAXED);
 
-void bfree(void *ptr)
-{
-    if (ptr == BNULL)
+    for (unsigned i = 0; i < BUDDY_STATS_SLOTS; i++)
     {
-        return;
+        slot = &stats_slots[i];
+        stats->allocs += __atomic_load_n(&slot->allocs, __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&slot->frees, __ATOMIC_RELAXED);
+        allocated += __atomic_load_n(&slot->allocated, __ATOMIC_RELAXED);
+        freed += __atomic_load_n(&slot->freed, __ATOMIC_RELAXED);
     }
 
-    pthread_mutex_lock(&lock);
-    struct block *block = BLOCK(ptr);
-    block = join(block);
-    next = block;
-    pthread_mutex_unlock(&lock);
+    // a thread may free what another allocated, so only
+    // the sum of all slots is meaningful
+    stats->in_use = allocated - freed;
 }
+#endif
 
-void *brealloc(void *ptr, size_t size)
+#ifdef BUDDY_PROFILE
+int buddy_profile_dump(const char *path)
 {
-    pthread_mutex_lock(&lock);
-    struct block *block, *buddy;
-    size_t block_size;
-    byte_t *new_ptr;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int result;
 
-    if (ptr == BNULL)
+    if (fd == -1)
     {
-        pthread_mutex_unlock(&lock);
-        return balloc(size);
+        return -1;
     }
 
-    if (size == 0)
+    profile_lock();
+    result = write_profile(fd);
+    profile_unlock();
+
+    if (close(fd) == -1)
     {
-        bfree(ptr);
-        pthread_mutex_unlock(&lock);
-        return BNULL;
+        result = -1;
     }
 
-    block = BLOCK(ptr);
+    return result;
+}
+#endif
+
+#ifdef BUDDY_STDLIB_OVERRIDE
+int malloc_trim(size_t pad)
+{
+    (void) pad;
+    return btrim() > 0;
+}
 
-    if (MEMSIZE(block) >= size)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
     {
-        while ((block->size / 2 - MEMOFFSET) >= size)
-        {
-            split(block);
-        }
-        next = NEXT(block);
-        pthread_mutex_unlock(&lock);
-        return block->mem;
+        return EINVAL;
     }
 
-    block_size = block->size;
-
-    // try to grow current block by joining
-    // with only right buddies
-    for (;;)
+    if (size == 0)
     {
-        if (block_size >= BLOCKSIZE(size))
-        {
-            block->size = block_size;
-            next = NEXT(block);
-            pthread_mutex_unlock(&lock);
-            return block->mem;
-        }
-
-        buddy = (struct block *) ((byte_t *) block + block_size);
-
-        if (BYTEDIFF(start, block) % (block_size * 2) > 0 ||
-            buddy == end ||
-            buddy->size != block_size ||
-            buddy->used)
-        {
-            break;
-        }
-
-        block_size *= 2;
+        *memptr = BNULL;
+        return 0;
     }
 
-    block_size = block->size;
-    bfree(ptr);
+    *memptr = baligned_alloc(alignment, size);
+    return *memptr == BNULL ? ENOMEM : 0;
+}
 
-    new_ptr = balloc(size);
-    if (new_ptr == BNULL)
+void *memalign(size_t alignment, size_t size)
+{
+    // like glibc, round odd alignments up to a power of two
+    if (alignment > 1 && (alignment & (alignment - 1)) != 0)
     {
-        // restore freed block
-        block->size = block_size;
-        block->used = 1;
-        pthread_mutex_unlock(&lock);
-        return BNULL;
+        alignment = (size_t) 1 << (MAXORDER - __builtin_clzll(alignment));
     }
 
-    if (new_ptr < (byte_t *)ptr)
+    return baligned_alloc(alignment > 0 ? alignment : 1, size);
+}
+
+void *valloc(size_t size)
+{
+    if (!is_init())
     {
-        for (size_t i = 0; i < MEMSIZE(block); i++)
-        {
-            new_ptr[i] = ((byte_t *)ptr)[i];
-        }
+        init();
     }
-    else
+
+    return baligned_alloc(pagesize, size);
+}
+
+void *pvalloc(size_t size)
+{
+    if (!is_init())
     {
-        for (size_t i = MEMSIZE(block); i > 0; i--)
-        {
-            new_ptr[i - 1] = ((byte_t *)ptr)[i - 1];
-        }
+        init();
     }
 
-    pthread_mutex_unlock(&lock);
-    return new_ptr;
+    return baligned_alloc(pagesize, ALIGNUP(size, pagesize));
 }
 
-void *bcalloc(size_t nitems, size_t size)
+#ifdef BUDDY_STATS
+// the heap is the main arena of glibc, and blocks with a mapping
+// of their own its mmap'd chunks. objects in thread caches and
+// slabs count as in use, like those in glibc's tcache
+struct mallinfo2 mallinfo2(void)
 {
-    size *= nitems;
-    char *ptr = balloc(size);
-    if (ptr == BNULL)
+    struct mallinfo2 info;
+    buddy_stats_t stats;
+
+    buddy_stats(&stats);
+    memset(&info, 0, sizeof(info));
+    info.arena = stats.heap;
+    info.ordblks = stats.free_blocks;
+    info.hblks = stats.large_blocks;
+    info.hblkhd = stats.large_bytes;
+    info.uordblks = stats.heap - stats.free_bytes;
+    info.fordblks = stats.free_bytes;
+    return info;
+}
+
+void malloc_stats(void)
+{
+    buddy_stats_t stats;
+    char buf[1024];
+    int length;
+
+    buddy_stats(&stats);
+
+    // stdio may allocate, so format into a buffer of our own
+    length = snprintf(buf, sizeof(buf),
+                      "system bytes     = %10zu\n"
+                      "in use bytes     = %10zu\n"
+                      "allocations      = %10zu\n"
+                      "frees            = %10zu\n"
+                      "superblock bytes = %10zu\n"
+                      "free bytes       = %10zu\n"
+                      "free blocks      = %10zu\n"
+                      "mmap regions     = %10zu\n"
+                      "mmap bytes       = %10zu\n"
+                      "grows            = %10zu\n"
+                      "splits           = %10zu\n"
+                      "joins            = %10zu\n"
+                      "released bytes   = %10zu\n"
+                      "tcache fills     = %10zu\n"
+                      "tcache flushes   = %10zu\n"
+                      "slabs            = %10zu\n",
+                      stats.heap + stats.large_bytes, stats.in_use,
+                      stats.allocs, stats.frees, stats.heap,
+                      stats.free_bytes, stats.free_blocks,
+                      stats.large_blocks, stats.large_bytes,
+                      stats.grows, stats.splits, stats.joins,
+                      stats.released, stats.fills, stats.flushes,
+                      stats.slabs);
+
+    if (length > 0)
     {
-        return BNULL;
+        (void) write(STDERR_FILENO, buf, (size_t) length < sizeof(buf) ?
+                                         (size_t) length : sizeof(buf) - 1);
     }
-    memset(ptr, 0, size);
-    return ptr;
 }
+#endif
 
-#ifdef BUDDY_STDLIB_OVERRIDE
 #pragma GCC diagnostic pop
 #endif
 
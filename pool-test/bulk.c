@@ -0,0 +1,80 @@
+/*
+ * pool_alloc_bulk across a chunk boundary, see README.md
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POOL_STATS
+#define POOL_IMPLEMENTATION
+#include "../pool.h"
+
+#define BLOCK 48
+#define BURST 255
+
+/* the chunks handed to the pool, in order */
+struct chunks {
+    size_t count;
+    uint8_t * start[8];
+    size_t size[8];
+};
+
+static void * chunk_alloc (size_t size, void * ctx)
+{
+    struct chunks * chunks = ctx;
+    void * ptr = malloc(size);
+
+    assert(chunks->count < 8);
+    chunks->start[chunks->count] = ptr;
+    chunks->size[chunks->count++] = size;
+    return ptr;
+}
+
+static void chunk_free (void * ptr, size_t size, void * ctx)
+{
+    (void) size;
+    (void) ctx;
+    free(ptr);
+}
+
+int main (void)
+{
+    struct chunks chunks = { 0 };
+    pool_backing_t backing = { chunk_alloc, chunk_free, &chunks };
+    void * out[BURST];
+    uint8_t * last = PNULL;
+    pool_t P;
+
+    assert(pool_init(&P, BLOCK, &backing) != -1);
+
+    /* the first chunk, with one block carved */
+    assert(pool_alloc(&P) != PNULL);
+    assert(chunks.count == 1);
+
+    assert(pool_alloc_bulk(&P, out, BURST) == 0);
+    assert(chunks.count == 2);
+    assert(P.carved == 1 + BURST);
+
+    /* the first chunk is used up before the second is taken */
+    for (size_t i = 0; i < BURST; i++)
+    {
+        uint8_t * ptr = out[i];
+
+        if (ptr >= chunks.start[0] && ptr < chunks.start[0] + chunks.size[0])
+        {
+            assert(last == PNULL || ptr == last + P.block_size);
+            last = ptr;
+        }
+    }
+
+    assert(last != PNULL);
+    assert((size_t) (chunks.start[0] + chunks.size[0] - last) <
+           2 * P.block_size);
+
+    pool_free_bulk(&P, out, BURST);
+    pool_destroy(&P);
+
+    printf("bulk: ok\n");
+    return 0;
+}
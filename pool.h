@@ -1,4 +1,3 @@
-
 #ifndef POOL_H
 #define POOL_H
 
@@ -17,10 +16,84 @@
  *         pfree (ptr);
  *     }
  *
+ * POOL_BLOCK_SIZE may be any size, 40 byte objects take 40 byte
+ * blocks. Blocks are aligned like those of pool_init, or to
+ * POOL_BLOCK_ALIGN if it is defined.
+ *
+ * Define POOL_THREAD_SAFE to share the pool between threads.
+ * The free list is then a lock-free stack, and only growing
+ * the pool takes a lock.
+ *
+ * Pools of other sizes can be made as pool_t instances, backed
+ * by malloc, or POOL_MALLOC / POOL_FREE if POOL_NO_STDLIB is
+ * defined, or by a pool_backing_t. The global pool above is only
+ * compiled if POOL_BLOCK_SIZE is defined.
+ *
+ *     pool_t P;
+ *     assert(pool_init(&P, 48, PNULL) != -1);
+ *
+ *     void * ptr = pool_alloc(&P);
+ *     pool_free(&P, ptr);
+ *     pool_destroy(&P);
+ *
+ * pool_t instances are not thread safe, except for pool_free_remote:
+ * a thread handing blocks to another, which allocated them, frees
+ * them with one atomic push onto a second list. The thread allocating
+ * from the pool takes that list back all at once when its own free
+ * list runs out.
+ *
+ * Define POOL_STATS, in every file including pool.h, to count
+ * allocations for pstats and pool_stats.
+ *
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define PNULL ((void *) 0)
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where a pool_t gets its memory from. `alloc` returns
+ * PNULL on failure, `free` is given the size passed to
+ * `alloc`, and both are passed `ctx`.
+ */
+typedef struct {
+    void * (* alloc) (size_t size, void * ctx);
+    void (* free) (void * ptr, size_t size, void * ctx);
+    void * ctx;
+} pool_backing_t;
+
+typedef struct {
+    size_t block_size;
+    size_t chunk_size;
+    void * free_head;
+    /* blocks freed by pool_free_remote, taken back by the owner */
+    void * remote;
+    uint8_t * front;
+    uint8_t * end;
+    void * chunks;
+    pool_backing_t backing;
+#ifdef POOL_STATS
+    size_t allocs;
+    size_t frees;
+    size_t carved;
+#endif
+} pool_t;
+
+#ifdef POOL_STATS
+typedef struct {
+    size_t allocs;         /* blocks allocated so far */
+    size_t frees;          /* blocks freed so far */
+    size_t in_use;         /* blocks allocated and not freed */
+    size_t free_blocks;    /* blocks on the free list */
+    size_t reserved;       /* bytes taken from the break or backing */
+} pool_stats_t;
+#endif
+
 /*
  * Allocates a new memory block of size POOL_BLOCK_SIZE.
  * Returns PNULL on failure.
@@ -32,17 +105,121 @@ void * palloc (void);
  */
 void pfree (void * ptr);
 
+/*
+ * Allocates `n` blocks of size POOL_BLOCK_SIZE into `out`, growing
+ * the pool once for all of them. Returns -1 on failure, with no
+ * blocks allocated, and 0 otherwise.
+ */
+int palloc_bulk (void ** out, size_t n);
+
+/*
+ * Frees the `n` blocks in `ptrs` at once.
+ */
+void pfree_bulk (void ** ptrs, size_t n);
+
+/*
+ * Initializes a pool of blocks of size `block_size`, getting
+ * memory from `backing`, or malloc if it is PNULL. Blocks are
+ * aligned to the largest power of two dividing `block_size`,
+ * up to that of max_align_t. Returns -1 on failure and 0
+ * otherwise.
+ */
+int pool_init (pool_t * P, size_t block_size, const pool_backing_t * backing);
+
+/*
+ * Allocates a block from `P`.
+ * Returns PNULL on failure.
+ */
+void * pool_alloc (pool_t * P);
+
+/*
+ * Frees block `ptr` allocated from `P`.
+ */
+void pool_free (pool_t * P, void * ptr);
+
+/*
+ * Frees block `ptr` allocated from `P`, from any thread. Safe to
+ * call while the thread using `P` allocates from it, but not
+ * after pool_destroy.
+ */
+void pool_free_remote (pool_t * P, void * ptr);
+
+/*
+ * Allocates `n` blocks from `P` into `out`, getting at most one
+ * chunk from the backing. Returns -1 on failure, with no blocks
+ * allocated, and 0 otherwise.
+ */
+int pool_alloc_bulk (pool_t * P, void ** out, size_t n);
+
+/*
+ * Frees the `n` blocks in `ptrs`, allocated from `P`, at once.
+ */
+void pool_free_bulk (pool_t * P, void ** ptrs, size_t n);
+
+/*
+ * Frees every block of `P` and the memory behind them.
+ */
+void pool_destroy (pool_t * P);
+
+#ifdef POOL_STATS
+/*
+ * Fills `stats` with the counters of the global pool. With
+ * POOL_THREAD_SAFE the counts are summed from per-thread slots,
+ * so they only add up exactly while no other thread allocates
+ * or frees.
+ */
+void pstats (pool_stats_t * stats);
+
+/*
+ * Fills `stats` with the counters of `P`. Blocks freed by
+ * pool_free_remote count as in use until `P` takes them back.
+ */
+void pool_stats (pool_t * P, pool_stats_t * stats);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 #ifdef POOL_IMPLEMENTATION
 #undef POOL_IMPLEMENTATION
 
-#include <stddef.h>
+#ifdef POOL_NO_STDLIB
+    #ifndef POOL_MALLOC
+        #error POOL_MALLOC must be defined
+    #endif
+    #ifndef POOL_FREE
+        #error POOL_FREE must be defined
+    #endif
+#else
+    #include <stdlib.h>
+    #define POOL_MALLOC(size) malloc(size)
+    #define POOL_FREE(ptr) free(ptr)
+#endif
+
+/* the first chunk of a pool_t, later ones double up to POOL_MAX_CHUNK */
+#ifndef POOL_CHUNK
+#define POOL_CHUNK 4096
+#endif
+
+#ifndef POOL_MAX_CHUNK
+#define POOL_MAX_CHUNK (1024 * 1024)
+#endif
+
+#ifdef POOL_STATS
+#define POOL_STAT(expr) (expr)
+#else
+#define POOL_STAT(expr) ((void) 0)
+#endif
+
+#ifdef POOL_BLOCK_SIZE
+
 #include <unistd.h>
-#include <stdint.h>
 
-#ifndef POOL_BLOCK_SIZE
-#error POOL_BLOCK_SIZE must be defined.
+#ifdef POOL_THREAD_SAFE
+#include <pthread.h>
 #endif
 
 #define PROGRAM_BREAK_INCREMENT 4096
@@ -51,42 +228,337 @@ void pfree (void * ptr);
 #define PROGRAM_BREAK_INCREMENT (POOL_BLOCK_SIZE)
 #endif
 
-#define BLOCK_SIZE (POOL_BLOCK_SIZE)
+/* the largest power of two dividing the size, up to max_align_t */
+#ifndef POOL_BLOCK_ALIGN
+#define POOL_BLOCK_ALIGN \
+    (((POOL_BLOCK_SIZE) & -(POOL_BLOCK_SIZE)) < _Alignof(max_align_t) ? \
+     ((POOL_BLOCK_SIZE) & -(POOL_BLOCK_SIZE)) : _Alignof(max_align_t))
+#endif
 
 union block
 {
     union block * next_free;
 
-    _Alignas(max_align_t)
+    _Alignas(POOL_BLOCK_ALIGN)
     uint8_t mem[POOL_BLOCK_SIZE];
 };
 
-_Static_assert((BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
-               "POOL_BLOCK_SIZE must be a power of two");
+/* POOL_BLOCK_SIZE rounded up to the alignment, and room for next_free */
+#define BLOCK_SIZE (sizeof(union block))
+#define BLOCK_ALIGN (_Alignof(union block))
+
+#ifdef POOL_THREAD_SAFE
+
+/*
+ * The free list head is a pointer tagged with a counter that
+ * changes on every push and pop, so a pop that raced with
+ * others fails its exchange even if the same block is back
+ * on top of the list (ABA).
+ */
+#if UINTPTR_MAX > 0xffffffffu
+/* user space addresses fit in 48 bits */
+#define TAG_SHIFT 48
+#else
+#define TAG_SHIFT 32
+#endif
+
+#define TAG_PTR(head) \
+    ((union block *) (uintptr_t) ((head) & (((uint64_t) 1 << TAG_SHIFT) - 1)))
+#define TAG_NEXT(head, ptr) \
+    (((((head) >> TAG_SHIFT) + 1) << TAG_SHIFT) | (uintptr_t) (ptr))
+
+static uint64_t __free_head;
+/* guards __front, __end and the program break */
+static pthread_mutex_t __grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#else
 
 static union block * __free_head;
+
+#endif
+
 static union block * __front;
 static union block * __end;
 
+#ifdef POOL_STATS
+
+/* blocks cut from the break, and the bytes taken from it */
+static size_t __carved;
+static size_t __reserved;
+
+#ifdef POOL_THREAD_SAFE
+
+#ifndef POOL_STATS_SLOTS
+#define POOL_STATS_SLOTS 64
+#endif
+
+/*
+ * Counters of the threads using a slot. Threads take slots
+ * in turn, so until there are more threads than slots each
+ * counts on a cache line of its own.
+ */
+struct __stats_slot
+{
+    _Alignas(64) size_t allocs;
+    size_t frees;
+};
+
+static struct __stats_slot __stats_slots[POOL_STATS_SLOTS];
+static unsigned __stats_next_slot;
+static _Thread_local struct __stats_slot * __thread_slot;
+
+static struct __stats_slot * __get_stats_slot (void)
+{
+    unsigned n;
+
+    if (!__thread_slot)
+    {
+        n = __atomic_fetch_add(&__stats_next_slot, 1, __ATOMIC_RELAXED);
+        __thread_slot = &__stats_slots[n % POOL_STATS_SLOTS];
+    }
+
+    return __thread_slot;
+}
+
+#define POOL_COUNT(field, n) \
+    ((void) __atomic_fetch_add(&__get_stats_slot()->field, (n), \
+                               __ATOMIC_RELAXED))
+
+#else
+
+static size_t __allocs;
+static size_t __frees;
+
+#define POOL_COUNT(field, n) ((void) (__##field += (n)))
+
+#endif
+
+#else
+#define POOL_COUNT(field, n) ((void) 0)
+#endif
+
 __attribute__((constructor))
 static void __init (void)
 {
+#ifndef POOL_THREAD_SAFE
     __free_head = PNULL;
+#endif
     __front = (union block *) sbrk(0);
     __end = __front;
 }
 
-static int __more (void)
+/*
+ * Grows the break by at least `size` bytes, returns 0 on failure.
+ */
+static int __more (size_t size)
 {
-    if (sbrk(PROGRAM_BREAK_INCREMENT) == (void *) -1)
+    size_t increment = (size + PROGRAM_BREAK_INCREMENT - 1) /
+                       PROGRAM_BREAK_INCREMENT * PROGRAM_BREAK_INCREMENT;
+    uint8_t * mem;
+
+    if (increment < size || increment > INTPTR_MAX)
     {
         return 0;
     }
 
-    __end = (union block *) sbrk(0);
+    mem = sbrk((intptr_t) increment);
+    if (mem == (void *) -1)
+    {
+        return 0;
+    }
+
+    /* someone else (malloc) moved the break since we last
+     * grew, so the memory at __front is not ours anymore */
+    if (mem != (uint8_t *) __end)
+    {
+        __front = (union block *) (((uintptr_t) mem + BLOCK_ALIGN - 1) &
+                                   ~(uintptr_t) (BLOCK_ALIGN - 1));
+    }
+
+    __end = (union block *) (mem + increment);
+    POOL_STAT(__reserved += increment);
+    return 1;
+}
+
+/*
+ * Makes room for `count` more blocks at __front, returns 0 on failure.
+ */
+static int __reserve (size_t count)
+{
+    size_t room;
+
+    if (count > SIZE_MAX / BLOCK_SIZE)
+    {
+        return 0;
+    }
+
+    room = (size_t) ((uint8_t *) __end - (uint8_t *) __front);
+    while (room < count * BLOCK_SIZE)
+    {
+        /* if the break moved, the new memory may need aligning,
+         * in which case this runs one more time */
+        if (!__more(count * BLOCK_SIZE - room))
+        {
+            return 0;
+        }
+        room = (size_t) ((uint8_t *) __end - (uint8_t *) __front);
+    }
+
     return 1;
 }
 
+#ifdef POOL_THREAD_SAFE
+
+/*
+ * Returns PNULL if the free list is empty.
+ */
+static void * __pop_free (void)
+{
+    uint64_t head = __atomic_load_n(&__free_head, __ATOMIC_ACQUIRE);
+    union block * block;
+    union block * next;
+
+    do
+    {
+        block = TAG_PTR(head);
+        if (block == PNULL)
+        {
+            return PNULL;
+        }
+
+        /* another thread may take and reuse the block before our
+         * exchange, reading it is still safe since the pool never
+         * shrinks, and the tag makes the exchange fail */
+        next = __atomic_load_n(&block->next_free, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_compare_exchange_n(&__free_head, &head,
+                                        TAG_NEXT(head, next), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return (void *) block;
+}
+
+static void __push_free (union block * block)
+{
+    uint64_t head = __atomic_load_n(&__free_head, __ATOMIC_RELAXED);
+
+    do
+    {
+        __atomic_store_n(&block->next_free, TAG_PTR(head), __ATOMIC_RELAXED);
+    }
+    while (!__atomic_compare_exchange_n(&__free_head, &head,
+                                        TAG_NEXT(head, block), 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void * palloc (void)
+{
+    void * ptr = __pop_free();
+
+    if (ptr)
+    {
+        POOL_COUNT(allocs, 1);
+        return ptr;
+    }
+
+    pthread_mutex_lock(&__grow_lock);
+    if (!__reserve(1))
+    {
+        ptr = PNULL;
+    }
+    else
+    {
+        ptr = (void *) __front++;
+        POOL_STAT(__carved++);
+        POOL_COUNT(allocs, 1);
+    }
+    pthread_mutex_unlock(&__grow_lock);
+
+    return ptr;
+}
+
+void pfree (void * ptr)
+{
+    POOL_COUNT(frees, 1);
+    __push_free((union block *) ptr);
+}
+
+int palloc_bulk (void ** out, size_t n)
+{
+    size_t count = 0;
+    int ok;
+
+    /* blocks are popped one at a time, walking further down the
+     * list before the exchange could follow a next_free that was
+     * overwritten by a block's new owner */
+    while (count < n && (out[count] = __pop_free()) != PNULL)
+    {
+        count++;
+    }
+
+    POOL_COUNT(allocs, count);
+    if (count == n)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&__grow_lock);
+    ok = __reserve(n - count);
+    if (ok)
+    {
+        POOL_STAT(__carved += n - count);
+        POOL_COUNT(allocs, n - count);
+    }
+    while (ok && count < n)
+    {
+        out[count++] = (void *) __front++;
+    }
+    pthread_mutex_unlock(&__grow_lock);
+
+    if (!ok)
+    {
+        pfree_bulk(out, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+void pfree_bulk (void ** ptrs, size_t n)
+{
+    union block * first;
+    union block * last;
+    uint64_t head;
+
+    if (n == 0)
+    {
+        return;
+    }
+
+    POOL_COUNT(frees, n);
+
+    /* link the blocks into one chain and push it in one step */
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        __atomic_store_n(&((union block *) ptrs[i])->next_free,
+                         (union block *) ptrs[i + 1], __ATOMIC_RELAXED);
+    }
+
+    first = (union block *) ptrs[0];
+    last = (union block *) ptrs[n - 1];
+    head = __atomic_load_n(&__free_head, __ATOMIC_RELAXED);
+
+    do
+    {
+        __atomic_store_n(&last->next_free, TAG_PTR(head), __ATOMIC_RELAXED);
+    }
+    while (!__atomic_compare_exchange_n(&__free_head, &head,
+                                        TAG_NEXT(head, first), 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#else
+
 static void * __pop_free (void)
 {
     void * ptr = (void *) __free_head;
@@ -98,21 +570,380 @@ void * palloc (void)
 {
     if (__free_head)
     {
+        POOL_COUNT(allocs, 1);
         return __pop_free();
     }
 
-    if (__front + BLOCK_SIZE > __end && !__more())
+    if (!__reserve(1))
     {
         return PNULL;
     }
 
+    POOL_STAT(__carved++);
+    POOL_COUNT(allocs, 1);
     return (void *) __front++;
 }
 
 void pfree (void * ptr)
 {
+    POOL_COUNT(frees, 1);
     ((union block *) ptr)->next_free = __free_head;
     __free_head = (union block *) ptr;
 }
 
+int palloc_bulk (void ** out, size_t n)
+{
+    size_t count = 0;
+
+    while (count < n && __free_head)
+    {
+        out[count++] = __pop_free();
+    }
+
+    POOL_COUNT(allocs, count);
+    if (count < n && !__reserve(n - count))
+    {
+        pfree_bulk(out, count);
+        return -1;
+    }
+
+    POOL_STAT(__carved += n - count);
+    POOL_COUNT(allocs, n - count);
+    while (count < n)
+    {
+        out[count++] = (void *) __front++;
+    }
+
+    return 0;
+}
+
+void pfree_bulk (void ** ptrs, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    POOL_COUNT(frees, n);
+
+    /* link the blocks into one chain and splice it in */
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        ((union block *) ptrs[i])->next_free = (union block *) ptrs[i + 1];
+    }
+
+    ((union block *) ptrs[n - 1])->next_free = __free_head;
+    __free_head = (union block *) ptrs[0];
+}
+
+#endif
+
+#ifdef POOL_STATS
+void pstats (pool_stats_t * stats)
+{
+    size_t carved;
+
+#ifdef POOL_THREAD_SAFE
+    /* a thread may free what another allocated, so only
+     * the sum of all slots is meaningful */
+    stats->allocs = 0;
+    stats->frees = 0;
+    for (size_t i = 0; i < POOL_STATS_SLOTS; i++)
+    {
+        stats->allocs += __atomic_load_n(&__stats_slots[i].allocs,
+                                         __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&__stats_slots[i].frees,
+                                        __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&__grow_lock);
+    carved = __carved;
+    stats->reserved = __reserved;
+    pthread_mutex_unlock(&__grow_lock);
+#else
+    stats->allocs = __allocs;
+    stats->frees = __frees;
+    carved = __carved;
+    stats->reserved = __reserved;
+#endif
+
+    /* every block cut from the break is in use or free */
+    stats->in_use = stats->allocs - stats->frees;
+    stats->free_blocks = carved > stats->in_use ? carved - stats->in_use : 0;
+}
+#endif
+
+#endif /* POOL_BLOCK_SIZE */
+
+/*
+ * The memory of a pool_t comes in chunks, linked so they
+ * can be freed by pool_destroy. Blocks start right after
+ * the header.
+ */
+struct pool_chunk
+{
+    struct pool_chunk * next;
+    size_t size;
+};
+
+#define CHUNK_HEADER \
+    ((sizeof(struct pool_chunk) + _Alignof(max_align_t) - 1) & \
+     ~(size_t) (_Alignof(max_align_t) - 1))
+
+static void * __default_alloc (size_t size, void * ctx)
+{
+    (void) ctx;
+    return POOL_MALLOC(size);
+}
+
+static void __default_free (void * ptr, size_t size, void * ctx)
+{
+    (void) size;
+    (void) ctx;
+    POOL_FREE(ptr);
+}
+
+int pool_init (pool_t * P, size_t block_size, const pool_backing_t * backing)
+{
+    if (block_size == 0 || block_size > POOL_MAX_CHUNK)
+    {
+        return -1;
+    }
+
+    /* room for the free list link, and keep blocks aligned */
+    P->block_size = (block_size + sizeof(void *) - 1) &
+                    ~(sizeof(void *) - 1);
+    P->chunk_size = POOL_CHUNK;
+    P->free_head = PNULL;
+    P->remote = PNULL;
+    P->front = PNULL;
+    P->end = PNULL;
+    P->chunks = PNULL;
+    POOL_STAT(P->allocs = P->frees = P->carved = 0);
+
+    if (backing)
+    {
+        P->backing = *backing;
+    }
+    else
+    {
+        P->backing.alloc = __default_alloc;
+        P->backing.free = __default_free;
+        P->backing.ctx = PNULL;
+    }
+
+    return 0;
+}
+
+/*
+ * Gets a chunk with room for at least `count` blocks,
+ * returns 0 on failure.
+ */
+static int __pool_more (pool_t * P, size_t count)
+{
+    size_t size = CHUNK_HEADER + count * P->block_size;
+    struct pool_chunk * chunk;
+
+    if (count > (SIZE_MAX - CHUNK_HEADER) / P->block_size)
+    {
+        return 0;
+    }
+
+    if (size < P->chunk_size)
+    {
+        size = P->chunk_size;
+    }
+
+    chunk = P->backing.alloc(size, P->backing.ctx);
+    if (chunk == PNULL)
+    {
+        return 0;
+    }
+
+    chunk->next = P->chunks;
+    chunk->size = size;
+    P->chunks = chunk;
+    /* what is left of the previous chunk is less than a block */
+    P->front = (uint8_t *) chunk + CHUNK_HEADER;
+    P->end = (uint8_t *) chunk + size;
+
+    if (P->chunk_size < POOL_MAX_CHUNK)
+    {
+        P->chunk_size *= 2;
+    }
+
+    return 1;
+}
+
+/*
+ * Takes back the blocks other threads freed, which are linked
+ * like the free list already. Returns 0 if there were none.
+ */
+static int __pool_reclaim (pool_t * P)
+{
+    if (__atomic_load_n(&P->remote, __ATOMIC_RELAXED) == PNULL)
+    {
+        return 0;
+    }
+
+    P->free_head = __atomic_exchange_n(&P->remote, PNULL, __ATOMIC_ACQUIRE);
+
+#ifdef POOL_STATS
+    for (void * ptr = P->free_head; ptr; ptr = *(void **) ptr)
+    {
+        P->frees++;
+    }
+#endif
+
+    return 1;
+}
+
+void * pool_alloc (pool_t * P)
+{
+    void * ptr = P->free_head;
+
+    if (ptr == PNULL && __pool_reclaim(P))
+    {
+        ptr = P->free_head;
+    }
+
+    if (ptr)
+    {
+        P->free_head = *(void **) ptr;
+        POOL_STAT(P->allocs++);
+        return ptr;
+    }
+
+    if ((size_t) (P->end - P->front) < P->block_size && !__pool_more(P, 1))
+    {
+        return PNULL;
+    }
+
+    ptr = P->front;
+    P->front += P->block_size;
+    POOL_STAT(P->allocs++);
+    POOL_STAT(P->carved++);
+    return ptr;
+}
+
+void pool_free (pool_t * P, void * ptr)
+{
+    POOL_STAT(P->frees++);
+    *(void **) ptr = P->free_head;
+    P->free_head = ptr;
+}
+
+void pool_free_remote (pool_t * P, void * ptr)
+{
+    void * head = __atomic_load_n(&P->remote, __ATOMIC_RELAXED);
+
+    /* only the owner takes from the list, and all of it
+     * at once, so pushes can't suffer from ABA */
+    do
+    {
+        *(void **) ptr = head;
+    }
+    while (!__atomic_compare_exchange_n(&P->remote, &head, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+int pool_alloc_bulk (pool_t * P, void ** out, size_t n)
+{
+    size_t count = 0;
+    size_t room;
+
+    while (count < n && (P->free_head || __pool_reclaim(P)))
+    {
+        out[count] = P->free_head;
+        P->free_head = *(void **) out[count++];
+    }
+
+    POOL_STAT(P->allocs += count);
+    room = (size_t) (P->end - P->front) / P->block_size;
+    if (room < n - count)
+    {
+        /* use up this chunk before taking the next */
+        POOL_STAT(P->allocs += room);
+        POOL_STAT(P->carved += room);
+        while (room-- > 0)
+        {
+            out[count++] = P->front;
+            P->front += P->block_size;
+        }
+
+        if (!__pool_more(P, n - count))
+        {
+            pool_free_bulk(P, out, count);
+            return -1;
+        }
+    }
+
+    POOL_STAT(P->allocs += n - count);
+    POOL_STAT(P->carved += n - count);
+
+    while (count < n)
+    {
+        out[count++] = P->front;
+        P->front += P->block_size;
+    }
+
+    return 0;
+}
+
+void pool_free_bulk (pool_t * P, void ** ptrs, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    POOL_STAT(P->frees += n);
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        *(void **) ptrs[i] = ptrs[i + 1];
+    }
+
+    *(void **) ptrs[n - 1] = P->free_head;
+    P->free_head = ptrs[0];
+}
+
+void pool_destroy (pool_t * P)
+{
+    struct pool_chunk * chunk = P->chunks;
+    struct pool_chunk * next;
+
+    while (chunk)
+    {
+        next = chunk->next;
+        P->backing.free(chunk, chunk->size, P->backing.ctx);
+        chunk = next;
+    }
+
+    P->free_head = PNULL;
+    P->remote = PNULL;
+    P->front = PNULL;
+    P->end = PNULL;
+    P->chunks = PNULL;
+    P->chunk_size = POOL_CHUNK;
+    POOL_STAT(P->allocs = P->frees = P->carved = 0);
+}
+
+#ifdef POOL_STATS
+void pool_stats (pool_t * P, pool_stats_t * stats)
+{
+    struct pool_chunk * chunk;
+
+    stats->allocs = P->allocs;
+    stats->frees = P->frees;
+    stats->in_use = P->allocs - P->frees;
+    stats->free_blocks = P->carved - stats->in_use;
+    stats->reserved = 0;
+
+    for (chunk = P->chunks; chunk; chunk = chunk->next)
+    {
+        stats->reserved += chunk->size;
+    }
+}
+#endif
+
 #endif